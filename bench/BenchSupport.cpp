@@ -0,0 +1,199 @@
+#include "BenchSupport.h"
+#include "LatexCache.h"
+#include "latex.h"
+#include <QCoreApplication>
+#include <QFile>
+#include <QIODevice>
+#include <QJsonDocument>
+#include <QTextStream>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<uint64_t> allocation_total{0};
+static std::atomic<uint64_t> allocation_bytes{0};
+
+static void count_allocation(std::size_t size){
+    allocation_total.fetch_add(1, std::memory_order_relaxed);
+    allocation_bytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+#if defined(__GLIBC__)
+// Qt containers allocate through malloc and realloc, operator new ends up in malloc too,
+// so glibc's allocator is wrapped and every form is counted once
+extern "C" {
+void* __libc_malloc(std::size_t size);
+void* __libc_calloc(std::size_t count, std::size_t size);
+void* __libc_realloc(void* p, std::size_t size);
+void* __libc_memalign(std::size_t alignment, std::size_t size);
+void __libc_free(void* p);
+
+void* malloc(std::size_t size){
+    count_allocation(size);
+    return __libc_malloc(size);
+}
+
+void* calloc(std::size_t count, std::size_t size){
+    count_allocation(count * size);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* p, std::size_t size){
+    count_allocation(size);
+    return __libc_realloc(p, size);
+}
+
+void* memalign(std::size_t alignment, std::size_t size){
+    count_allocation(size);
+    return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(std::size_t alignment, std::size_t size){
+    count_allocation(size);
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** out, std::size_t alignment, std::size_t size){
+    count_allocation(size);
+    void* p = __libc_memalign(alignment, size);
+    if(!p) return ENOMEM;
+    *out = p;
+    return 0;
+}
+
+void free(void* p){
+    __libc_free(p);
+}
+}
+
+const char* allocationCounter(){
+    return "malloc";
+}
+#else
+// Elsewhere only C++ new is counted, Qt's malloc and realloc calls are missed
+void* operator new(std::size_t size){
+    count_allocation(size);
+    if(void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept{
+    count_allocation(size);
+    return std::malloc(size ? size : 1);
+}
+
+void operator delete(void* p) noexcept{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept{
+    std::free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept{
+    std::free(p);
+}
+
+const char* allocationCounter(){
+    return "cxx_new";
+}
+#endif
+
+allocation_count allocationsSoFar(){
+    return allocation_count{allocation_total.load(std::memory_order_relaxed), allocation_bytes.load(std::memory_order_relaxed)};
+}
+
+void PhaseSamples::addAllocations(const allocation_count& before, const allocation_count& after){
+    m_allocations.push_back(after.count - before.count);
+    m_allocated_bytes.push_back(after.bytes - before.bytes);
+}
+
+double PhaseSamples::min() const{
+    return m_times.empty() ? 0 : *std::min_element(m_times.begin(), m_times.end());
+}
+
+double PhaseSamples::median() const{
+    return percentile(50);
+}
+
+double PhaseSamples::percentile(double p) const{
+    if(m_times.empty()) return 0;
+    std::vector<double> sorted = m_times;
+    std::sort(sorted.begin(), sorted.end());
+    size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * sorted.size()));
+    return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+}
+
+template<typename T>
+static T median_of(std::vector<T> values){
+    std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+    return values[values.size() / 2];
+}
+
+QJsonObject PhaseSamples::toJson() const{
+    QJsonObject result;
+    result["samples"] = static_cast<qint64>(m_times.size());
+    result["min_ms"] = min();
+    result["median_ms"] = median();
+    result["p99_ms"] = percentile(99);
+    if(!m_allocations.empty()) {
+        result["allocations"] = static_cast<qint64>(median_of(m_allocations));
+        result["allocated_bytes"] = static_cast<qint64>(median_of(m_allocated_bytes));
+    }
+    return result;
+}
+
+void useOffscreenPlatform(){
+    if(qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+}
+
+void initMicroTeX(){
+    tex::LaTeX::setDebug(false);
+    QString resPath = QCoreApplication::applicationDirPath() + "/res";
+    tex::LaTeX::init(resPath.toStdString());
+}
+
+void releaseMicroTeX(){
+    LatexRenderCache::instance().waitForAsyncBuilds();
+    LatexRenderCache::instance().clear(); //renders hold MicroTeX boxes, drop them before its fonts go away
+    tex::LaTeX::release();
+}
+
+QString readTextFile(const QString& path){
+    QFile file(path);
+    if(!file.open(QIODevice::ReadOnly | QIODevice::Text)) return QString();
+    QTextStream in(&file);
+    return in.readAll();
+}
+
+QString defaultTestsDir(){
+    QString testsDir = QCoreApplication::applicationDirPath() + "/tests";
+    if(QFile::exists(testsDir)) return testsDir;
+#ifdef LATEXLABEL_TESTS_DIR
+    return QStringLiteral(LATEXLABEL_TESTS_DIR);
+#else
+    return "../tests";
+#endif
+}
+
+void writeJson(const QJsonObject& report, const QString& path){
+    QByteArray json = QJsonDocument(report).toJson(QJsonDocument::Indented);
+    if(path.isEmpty()) {
+        std::fwrite(json.constData(), 1, json.size(), stdout);
+        std::fflush(stdout);
+        return;
+    }
+    QFile file(path);
+    if(file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        file.write(json);
+    }
+    else {
+        std::fprintf(stderr, "Could not write %s\n", qPrintable(path));
+    }
+}
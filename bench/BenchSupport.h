@@ -0,0 +1,56 @@
+#pragma once
+
+#include <QElapsedTimer>
+#include <QJsonObject>
+#include <QString>
+#include <cstdint>
+#include <vector>
+
+// Heap allocations of the whole process. On glibc every malloc, calloc, realloc and
+// aligned allocation is counted, elsewhere only the replaced global operator new
+struct allocation_count{
+    uint64_t count=0;
+    uint64_t bytes=0;
+};
+allocation_count allocationsSoFar();
+const char* allocationCounter(); // "malloc" or "cxx_new", what allocationsSoFar counts
+
+// Samples of one phase, times in milliseconds
+class PhaseSamples{
+public:
+    void add(double ms) { m_times.push_back(ms); }
+    void addAllocations(const allocation_count& before, const allocation_count& after);
+
+    // Times run and counts what it allocates
+    template<typename F>
+    void measure(F&& run){
+        allocation_count before = allocationsSoFar();
+        QElapsedTimer timer;
+        timer.start();
+        run();
+        add(timer.nsecsElapsed() / 1e6);
+        addAllocations(before, allocationsSoFar());
+    }
+
+    size_t size() const { return m_times.size(); }
+    double last() const { return m_times.empty() ? 0 : m_times.back(); }
+    double min() const;
+    double median() const;
+    double percentile(double p) const; // nearest rank, p in [0,100]
+    QJsonObject toJson() const; // min/median/p99, allocation medians if any were recorded
+
+private:
+    std::vector<double> m_times;
+    std::vector<uint64_t> m_allocations;
+    std::vector<uint64_t> m_allocated_bytes;
+};
+
+// Selects the offscreen platform unless QT_QPA_PLATFORM is set, call before the QApplication is created
+void useOffscreenPlatform();
+// MicroTeX resources are copied next to the executables
+void initMicroTeX();
+void releaseMicroTeX();
+
+QString readTextFile(const QString& path); // empty if it can't be read
+QString defaultTestsDir();
+void writeJson(const QJsonObject& report, const QString& path); // stdout if path is empty
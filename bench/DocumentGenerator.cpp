@@ -0,0 +1,187 @@
+#include "DocumentGenerator.h"
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+static const char* const vocabulary[] = {
+    "the", "layout", "of", "a", "formula", "depends", "on", "its", "baseline", "and", "every",
+    "paragraph", "wraps", "words", "at", "the", "right", "margin", "while", "glyphs", "are",
+    "shaped", "once", "per", "run", "matrix", "vector", "field", "integral", "converges", "for",
+    "large", "values", "streaming", "tokens", "arrive", "faster", "than", "frames", "render"
+};
+static const char* const formulas[] = {
+    "x^{%1} + y^{%1} = z^{%1}",
+    "\\frac{a_{%1}}{b_{%1} + 1}",
+    "\\sqrt{%1 + \\alpha}",
+    "\\sum_{k=0}^{%1} k^2",
+    "e^{i \\pi %1}",
+    "\\int_0^{%1} f(x)\\,dx"
+};
+
+class text_source{
+public:
+    explicit text_source(unsigned seed) : m_random(seed) {}
+
+    int below(int n) { return std::uniform_int_distribution<int>(0, n - 1)(m_random); }
+
+    QString words(int count){
+        QString result;
+        for(int i = 0; i < count; i++) {
+            if(i > 0) result += ' ';
+            result += vocabulary[below(std::size(vocabulary))];
+        }
+        return result;
+    }
+
+    QString formula(int index){
+        //the index makes every formula its own cache entry
+        return QString(formulas[index % std::size(formulas)]).arg(index);
+    }
+
+private:
+    std::mt19937 m_random;
+};
+
+static int scale(int count, double factor){
+    return count > 0 ? std::max(1, static_cast<int>(std::lround(count * factor))) : 0;
+}
+
+document_params document_params::scaled(double factor) const{
+    document_params result = *this;
+    result.paragraphs = scale(paragraphs, factor);
+    result.inline_formulas = scale(inline_formulas, factor);
+    result.display_formulas = scale(display_formulas, factor);
+    result.headings = scale(headings, factor);
+    result.lists = scale(lists, factor);
+    result.tables = scale(tables, factor);
+    result.code_blocks = scale(code_blocks, factor);
+    return result;
+}
+
+static QString paragraph(text_source& source, int inline_formulas, int& formula_index){
+    QString result;
+    int sentences = 3 + source.below(4);
+    for(int i = 0; i < sentences; i++) {
+        QString sentence = source.words(6 + source.below(10));
+        sentence[0] = sentence[0].toUpper();
+        switch(source.below(6)) {
+            case 0: sentence += " **" + source.words(2) + "**"; break;
+            case 1: sentence += " *" + source.words(2) + "*"; break;
+            case 2: sentence += " `" + source.words(1) + "()`"; break;
+            default: break;
+        }
+        if(i < inline_formulas) {
+            sentence += " $" + source.formula(formula_index++) + "$";
+        }
+        result += sentence + ". ";
+    }
+    if(inline_formulas > sentences) {
+        //more formulas than sentences, the rest go at the end
+        for(int i = sentences; i < inline_formulas; i++) {
+            result += "$" + source.formula(formula_index++) + "$ ";
+        }
+    }
+    return result.trimmed() + "\n\n";
+}
+
+static QString list(text_source& source, const document_params& params, bool ordered){
+    QString result;
+    for(int i = 0; i < params.list_items; i++) {
+        //walk down to the deepest level and back up
+        int period = std::max(1, 2 * (params.list_depth - 1));
+        int phase = i % period;
+        int depth = params.list_depth > 1 ? std::min(phase, period - phase) : 0;
+        QString indent = QString(" ").repeated(depth * (ordered ? 3 : 2));
+        QString marker = ordered ? "1. " : "- ";
+        result += indent + marker + source.words(3 + source.below(8)) + "\n";
+    }
+    return result + "\n";
+}
+
+static QString table(text_source& source, const document_params& params){
+    QString header = "|", separator = "|";
+    for(int c = 0; c < params.table_columns; c++) {
+        header += " " + source.words(1) + QString::number(c) + " |";
+        separator += " --- |";
+    }
+    QString result = header + "\n" + separator + "\n";
+    for(int r = 0; r < params.table_rows; r++) {
+        QString row = "|";
+        for(int c = 0; c < params.table_columns; c++) {
+            row += " " + source.words(1 + source.below(3)) + " |";
+        }
+        result += row + "\n";
+    }
+    return result + "\n";
+}
+
+static QString code_block(text_source& source, const document_params& params, int index){
+    QString result = index % 2 ? "```cpp\n" : "```\n";
+    for(int i = 0; i < params.code_lines; i++) {
+        QString indent = QString(" ").repeated(4 * (i % 3));
+        result += indent + QString("auto value_%1 = compute(%2, \"%3\");\n").arg(i).arg(index).arg(source.words(2));
+    }
+    return result + "```\n\n";
+}
+
+QString generateDocument(const document_params& params){
+    text_source source(params.seed);
+    QString document;
+    int formula_index = 0;
+    int paragraphs = std::max(1, params.paragraphs);
+
+    //how many of a kind are due after paragraph p, so they are spread evenly
+    auto due = [paragraphs](int total, int p) { return static_cast<int>(static_cast<long long>(total) * (p + 1) / paragraphs); };
+    int inline_done = 0, display_done = 0, headings_done = 0, lists_done = 0, tables_done = 0, code_done = 0;
+
+    for(int p = 0; p < paragraphs; p++) {
+        while(headings_done < due(params.headings, p)) {
+            document += QString("#").repeated(1 + headings_done % 3) + " " + source.words(3 + source.below(4)) + "\n\n";
+            headings_done++;
+        }
+        int inline_formulas = due(params.inline_formulas, p) - inline_done;
+        inline_done += inline_formulas;
+        if(p < params.paragraphs) document += paragraph(source, inline_formulas, formula_index);
+
+        while(display_done < due(params.display_formulas, p)) {
+            document += "$$" + source.formula(formula_index++) + "$$\n\n";
+            display_done++;
+        }
+        while(lists_done < due(params.lists, p)) {
+            document += list(source, params, lists_done % 2 == 1);
+            lists_done++;
+        }
+        while(tables_done < due(params.tables, p)) {
+            document += table(source, params);
+            tables_done++;
+        }
+        while(code_done < due(params.code_blocks, p)) {
+            document += code_block(source, params, code_done);
+            code_done++;
+        }
+    }
+    return document;
+}
+
+QStringList splitIntoChunks(QStringView text, int words_per_chunk){
+    QStringList chunks;
+    words_per_chunk = std::max(1, words_per_chunk);
+    qsizetype start = 0;
+    int words = 0;
+    bool in_word = false;
+    for(qsizetype i = 0; i < text.size(); i++) {
+        bool space = text[i].isSpace();
+        if(in_word && space) {
+            words++;
+        }
+        in_word = !space;
+        //a chunk ends with the whitespace after its last word
+        if(words == words_per_chunk && !space) {
+            chunks.append(text.mid(start, i - start).toString());
+            start = i;
+            words = 0;
+        }
+    }
+    if(start < text.size()) chunks.append(text.mid(start).toString());
+    return chunks;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <QString>
+#include <QStringList>
+#include <QStringView>
+
+// Shape of a synthetic markdown document. Block counts are spread evenly
+// between the paragraphs so every part of the document has a bit of everything.
+struct document_params{
+    int paragraphs=40;
+    int inline_formulas=20; // spread over the paragraphs
+    int display_formulas=5;
+    int headings=4;
+    int lists=2;
+    int list_items=12; // per list
+    int list_depth=4; // nesting of the deepest item
+    int tables=1;
+    int table_rows=10;
+    int table_columns=8;
+    int code_blocks=2;
+    int code_lines=40; // per block
+    unsigned seed=1;
+
+    // Block counts multiplied by factor, depth and widths stay
+    document_params scaled(double factor) const;
+};
+
+QString generateDocument(const document_params& params);
+
+// Cuts text after every words_per_chunk words, the way a token stream arrives.
+// Concatenating the chunks gives text back.
+QStringList splitIntoChunks(QStringView text, int words_per_chunk=1);
@@ -0,0 +1,296 @@
+#include <QApplication>
+#include <QCommandLineOption>
+#include <QCommandLineParser>
+#include <QDir>
+#include <QImage>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QPainter>
+#include <QResizeEvent>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include "BenchSupport.h"
+#include "DocumentGenerator.h"
+#include "FormulaDiskCache.h"
+#include "LatexCache.h"
+#include "LatexLabel.h"
+
+struct bench_options{
+    int iterations=20;
+    int width=800;
+    int text_size=20;
+    int words_per_chunk=4; // appendText granularity of the scaling suite
+    int tile_threads=-1; // paint through the tile cache with this many workers, -1 paints directly
+};
+
+static void configure_label(LatexLabel& label, const bench_options& options){
+    label.setAsyncLatex(false); //builds are part of the measured phase
+    label.setBackgroundParsing(false); //setText has to finish inside the measured call
+    label.setTextSize(options.text_size);
+    label.setFixedWidth(options.width); //setText adjusts the size, only the height may follow
+    if(options.tile_threads >= 0) {
+        label.setTileCaching(true);
+        label.setTileThreads(options.tile_threads);
+    }
+}
+
+// One document through every phase, iterations times. Formulas are built cold
+// each time, the render cache is cleared before every setText.
+static QJsonObject bench_document(const QString& name, const QString& content, const bench_options& options){
+    PhaseSamples set_text, parse, latex, layout, relayout, paint;
+
+    LatexLabel label;
+    configure_label(label, options);
+
+    for(int i = 0; i < options.iterations; i++) {
+        LatexRenderCache::instance().clear();
+        label.resetTimings();
+        set_text.measure([&]() { label.setText(content); });
+        phase_timings timings = label.timings();
+        parse.add(timings.parse_ns / 1e6);
+        latex.add(timings.latex_ns / 1e6);
+        layout.add(timings.layout_ns / 1e6);
+
+        relayout.measure([&]() { label.relayout(options.width); });
+
+        label.resize(options.width, label.minimumHeight());
+        QImage image(label.size(), QImage::Format_ARGB32_Premultiplied);
+        image.fill(Qt::white);
+        paint.measure([&]() { label.render(&image); });
+    }
+
+    QJsonObject phases;
+    phases["set_text"] = set_text.toJson();
+    phases["parse"] = parse.toJson();
+    phases["latex"] = latex.toJson();
+    phases["layout"] = layout.toJson();
+    phases["relayout"] = relayout.toJson();
+    phases["paint"] = paint.toJson();
+
+    QJsonObject result;
+    result["file"] = name;
+    result["characters"] = static_cast<qint64>(content.size());
+    result["fragments"] = static_cast<qint64>(label.fragmentCount());
+    result["height"] = label.minimumHeight();
+    result["phases"] = phases;
+    return result;
+}
+
+// Streams content through appendText and compares the parsed structure with
+// what one setText of the whole content gives
+static bool streams_like_full_parse(const QString& content, const bench_options& options){
+    LatexLabel full;
+    configure_label(full, options);
+    full.setText(content);
+
+    LatexLabel streamed;
+    configure_label(streamed, options);
+    streamed.setText("");
+    for(QString& chunk : splitIntoChunks(content, options.words_per_chunk)) {
+        streamed.appendText(chunk);
+    }
+    return streamed.segmentsStructure() == full.segmentsStructure();
+}
+
+// Slope of log(time) over log(characters), 1 is linear and 2 quadratic
+static double scaling_exponent(const std::vector<double>& characters, const std::vector<double>& times){
+    double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for(size_t i = 0; i < characters.size(); i++) {
+        if(characters[i] <= 0 || times[i] <= 0) continue;
+        double x = std::log(characters[i]), y = std::log(times[i]);
+        n++; sx += x; sy += y; sxx += x*x; sxy += x*y;
+    }
+    double denominator = n*sxx - sx*sx;
+    return n < 2 || denominator == 0 ? 0 : (n*sxy - sx*sy) / denominator;
+}
+
+// Generated documents of growing size through setText, streamed appendText,
+// the relayout of a resize and a full paint.
+static QJsonObject bench_scaling(const QList<double>& factors, const bench_options& options){
+    document_params base;
+    QJsonArray sizes;
+    std::vector<double> characters;
+    std::vector<double> set_text_times, append_times, resize_times, paint_times;
+
+    for(double factor : factors) {
+        QString document = generateDocument(base.scaled(factor));
+        PhaseSamples set_text, append, append_total, resize, paint;
+
+        LatexLabel label;
+        configure_label(label, options);
+        for(int i = 0; i < options.iterations; i++) {
+            set_text.measure([&]() { label.setText(document); });
+        }
+
+        //one streamed pass, every append is a sample
+        QStringList chunks = splitIntoChunks(document, options.words_per_chunk);
+        LatexLabel streamed;
+        configure_label(streamed, options);
+        streamed.setText("");
+        append_total.measure([&]() {
+            for(QString& chunk : chunks) {
+                append.measure([&]() { streamed.appendText(chunk); });
+            }
+        });
+
+        //what a window resize does, narrower and back
+        QSize wide(options.width, label.minimumHeight());
+        QSize narrow(options.width * 3 / 4, label.minimumHeight());
+        for(int i = 0; i < options.iterations; i++) {
+            resize.measure([&]() {
+                QResizeEvent to_narrow(narrow, wide);
+                QCoreApplication::sendEvent(&label, &to_narrow);
+                QResizeEvent to_wide(wide, narrow);
+                QCoreApplication::sendEvent(&label, &to_wide);
+            });
+        }
+
+        label.resize(options.width, label.minimumHeight());
+        QImage image(label.size(), QImage::Format_ARGB32_Premultiplied);
+        for(int i = 0; i < options.iterations; i++) {
+            image.fill(Qt::white);
+            paint.measure([&]() { label.render(&image); });
+        }
+
+        QJsonObject phases;
+        phases["set_text"] = set_text.toJson();
+        phases["append"] = append.toJson();
+        phases["append_total"] = append_total.toJson();
+        phases["resize"] = resize.toJson();
+        phases["paint"] = paint.toJson();
+
+        QJsonObject size;
+        size["factor"] = factor;
+        size["characters"] = static_cast<qint64>(document.size());
+        size["appends"] = static_cast<qint64>(chunks.size());
+        size["fragments"] = static_cast<qint64>(label.fragmentCount());
+        size["phases"] = phases;
+        sizes.append(size);
+
+        characters.push_back(document.size());
+        set_text_times.push_back(set_text.median());
+        append_times.push_back(append_total.median());
+        resize_times.push_back(resize.median());
+        paint_times.push_back(paint.median());
+    }
+
+    QJsonObject exponents;
+    exponents["set_text"] = scaling_exponent(characters, set_text_times);
+    exponents["append_total"] = scaling_exponent(characters, append_times);
+    exponents["resize"] = scaling_exponent(characters, resize_times);
+    exponents["paint"] = scaling_exponent(characters, paint_times);
+
+    QJsonObject result;
+    result["sizes"] = sizes;
+    result["exponents"] = exponents;
+    return result;
+}
+
+int main(int argc, char* argv[]){
+    useOffscreenPlatform();
+    QApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Times parse, LaTeX, layout and paint of LatexLabel over the markdown test files, or over generated documents of growing size with --scaling 1,2,4,8. Prints JSON.");
+    parser.addHelpOption();
+    QCommandLineOption iterationsOption("iterations", "Runs per document.", "n", "20");
+    QCommandLineOption widthOption("width", "Layout width in pixels.", "px", "800");
+    QCommandLineOption textSizeOption("text-size", "Text size of the label.", "size", "20");
+    QCommandLineOption testsOption("tests", "Directory with the *.md documents.", "dir", defaultTestsDir());
+    QCommandLineOption outputOption("output", "Write the report to a file instead of stdout.", "file");
+    QCommandLineOption scalingOption("scaling", "Run generated documents scaled by each factor instead of the test files.", "factors");
+    QCommandLineOption chunkOption("words-per-chunk", "Words per appendText call when streaming.", "n", "4");
+    QCommandLineOption tilesOption("tile-threads", "Paint through the tile cache, rasterizing with n workers (0 for one per core).", "n");
+    QCommandLineOption formulaCacheOption("formula-cache", "Lay out and paint formulas from this disk cache, filling it on the first run.", "file");
+    QCommandLineOption checkStreamingOption("check-streaming", "Instead of timing, check that streaming each test file through appendText parses like one setText. Exits with 1 on a mismatch.");
+    parser.addOption(iterationsOption);
+    parser.addOption(widthOption);
+    parser.addOption(textSizeOption);
+    parser.addOption(testsOption);
+    parser.addOption(outputOption);
+    parser.addOption(scalingOption);
+    parser.addOption(chunkOption);
+    parser.addOption(tilesOption);
+    parser.addOption(formulaCacheOption);
+    parser.addOption(checkStreamingOption);
+    parser.process(app);
+
+    bench_options options;
+    options.iterations = std::max(1, parser.value(iterationsOption).toInt());
+    options.width = std::max(100, parser.value(widthOption).toInt());
+    options.text_size = std::max(1, parser.value(textSizeOption).toInt());
+    options.words_per_chunk = std::max(1, parser.value(chunkOption).toInt());
+    if(parser.isSet(tilesOption)) options.tile_threads = std::max(0, parser.value(tilesOption).toInt());
+
+    QJsonObject report;
+    report["platform"] = QGuiApplication::platformName();
+    report["allocations_counted"] = allocationCounter(); // what the allocation figures include
+    report["iterations"] = options.iterations;
+    report["width"] = options.width;
+    report["text_size"] = options.text_size;
+    report["tile_threads"] = options.tile_threads;
+    QDir testDirectory(parser.value(testsOption));
+    if(!parser.isSet(scalingOption) && !testDirectory.exists()) {
+        std::fprintf(stderr, "Tests directory not found: %s\n", qPrintable(testDirectory.path()));
+        return 1;
+    }
+    const QStringList files = testDirectory.entryList(QStringList() << "*.md", QDir::Files, QDir::Name);
+
+    if(parser.isSet(checkStreamingOption)) {
+        initMicroTeX();
+        int mismatches = 0;
+        for(const QString& file : files) {
+            QString content = readTextFile(testDirectory.filePath(file));
+            if(content.isEmpty()) continue;
+            if(!streams_like_full_parse(content, options)) {
+                std::fprintf(stderr, "Streaming %s parses differently from a full parse\n", qPrintable(file));
+                mismatches++;
+            }
+        }
+        releaseMicroTeX();
+        return mismatches == 0 ? 0 : 1;
+    }
+
+    if(parser.isSet(formulaCacheOption) && !FormulaDiskCache::instance().open(parser.value(formulaCacheOption))) {
+        std::fprintf(stderr, "Can't open the formula cache %s\n", qPrintable(parser.value(formulaCacheOption)));
+        return 1;
+    }
+
+    initMicroTeX();
+
+    if(parser.isSet(scalingOption)) {
+        QList<double> factors;
+        for(const QString& factor : parser.value(scalingOption).split(',', Qt::SkipEmptyParts)) {
+            if(factor.toDouble() > 0) factors.append(factor.toDouble());
+        }
+        report["words_per_chunk"] = options.words_per_chunk;
+        report["scaling"] = bench_scaling(factors, options);
+    }
+    else {
+        QJsonArray documents;
+        for(const QString& file : files) {
+            QString content = readTextFile(testDirectory.filePath(file));
+            if(content.isEmpty()) continue;
+            documents.append(bench_document(file, content, options));
+        }
+        report["documents"] = documents;
+    }
+
+    //both suites share the tail, the disk cache is reported and closed either way
+    if(FormulaDiskCache::instance().isOpen()) {
+        formula_disk_cache_stats stats = FormulaDiskCache::instance().stats();
+        QJsonObject formula_cache;
+        formula_cache["hits"] = static_cast<qint64>(stats.hits);
+        formula_cache["misses"] = static_cast<qint64>(stats.misses);
+        formula_cache["writes"] = static_cast<qint64>(stats.writes);
+        formula_cache["entries"] = static_cast<qint64>(stats.entries);
+        formula_cache["file_bytes"] = static_cast<qint64>(stats.file_bytes);
+        report["formula_cache"] = formula_cache;
+        FormulaDiskCache::instance().close();
+    }
+    writeJson(report, parser.value(outputOption));
+
+    releaseMicroTeX();
+    return 0;
+}
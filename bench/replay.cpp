@@ -0,0 +1,203 @@
+#include <QApplication>
+#include <QCommandLineOption>
+#include <QCommandLineParser>
+#include <QFile>
+#include <QIODevice>
+#include <QImage>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QPainter>
+#include <QRegion>
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+#include "BenchSupport.h"
+#include "DocumentGenerator.h"
+#include "LatexLabel.h"
+
+struct replay_options{
+    double rate=0; // chunks per second, 0 replays as fast as possible
+    int width=800;
+    int viewport_height=600; // what is repainted after every append, the end of the document
+    int text_size=20;
+    bool async_latex=true;
+};
+
+// A recorded stream is a JSON array of the chunks as they arrived
+static QStringList read_chunk_file(const QString& path){
+    QFile file(path);
+    if(!file.open(QIODevice::ReadOnly)) return QStringList();
+    QJsonDocument document = QJsonDocument::fromJson(file.readAll());
+    QStringList chunks;
+    if(!document.isArray()) return chunks;
+    for(const QJsonValue& chunk : document.array()) {
+        chunks.append(chunk.toString());
+    }
+    return chunks;
+}
+
+// Feeds the chunks to appendText back to back and times every step. At a
+// fixed rate the arrival schedule is replayed on a virtual clock: an append
+// starts when its chunk arrives or when the previous one is done, whichever is
+// later, so falling behind shows up as lag without waiting in real time.
+static QJsonObject replay(const QStringList& chunks, const replay_options& options){
+    PhaseSamples append, parse, latex, layout, invalidation, events, paint;
+    std::vector<double> latencies; // append to painted, per chunk
+    std::vector<qsizetype> lengths;
+
+    LatexLabel label;
+    label.setAsyncLatex(options.async_latex);
+    label.setBackgroundParsing(false); //latencies are measured per call
+    label.setTextSize(options.text_size);
+    label.setFixedWidth(options.width);
+    label.setText("");
+    QImage frame(options.width, options.viewport_height, QImage::Format_ARGB32_Premultiplied);
+
+    double interval = options.rate > 0 ? 1000.0 / options.rate : 0;
+    double clock = 0, max_lag = 0, lag = 0;
+    int behind = 0;
+    qsizetype characters = 0;
+
+    for(const QString& chunk : chunks) {
+        QString text = chunk;
+        label.resetTimings();
+        append.measure([&]() { label.appendText(text); });
+        phase_timings timings = label.timings();
+        double append_ms = append.last();
+        parse.add(timings.parse_ns / 1e6);
+        latex.add(timings.latex_ns / 1e6);
+        layout.add(timings.layout_ns / 1e6);
+        //the rest of appendText: dropping fragments, geometry and update requests
+        invalidation.add(std::max(0.0, append_ms - (timings.parse_ns + timings.latex_ns + timings.layout_ns) / 1e6));
+
+        //finished formulas come back as queued events
+        events.measure([&]() { QCoreApplication::processEvents(); });
+
+        QRect bottom(0, std::max(0, label.height() - options.viewport_height), options.width, options.viewport_height);
+        frame.fill(Qt::white);
+        paint.measure([&]() { label.render(&frame, QPoint(), QRegion(bottom)); });
+
+        double latency = append_ms + events.last() + paint.last();
+        latencies.push_back(latency);
+        characters += chunk.size();
+        lengths.push_back(characters);
+
+        if(interval > 0) {
+            double arrival = (latencies.size() - 1) * interval;
+            double start = std::max(arrival, clock);
+            lag = start - arrival;
+            if(lag > interval) behind++;
+            max_lag = std::max(max_lag, lag);
+            clock = start + latency;
+        }
+    }
+
+    QJsonObject phases;
+    phases["append"] = append.toJson();
+    phases["parse"] = parse.toJson();
+    phases["latex"] = latex.toJson();
+    phases["layout"] = layout.toJson();
+    phases["invalidation"] = invalidation.toJson();
+    phases["events"] = events.toJson();
+    phases["paint"] = paint.toJson();
+
+    //latency as the document grows, tenths of the stream
+    QJsonArray progress;
+    size_t bucket = std::max<size_t>(1, latencies.size() / 10);
+    for(size_t first = 0; first < latencies.size(); first += bucket) {
+        PhaseSamples part;
+        size_t last = std::min(latencies.size(), first + bucket);
+        for(size_t i = first; i < last; i++) {
+            part.add(latencies[i]);
+        }
+        QJsonObject entry = part.toJson();
+        entry["first_append"] = static_cast<qint64>(first);
+        entry["characters"] = static_cast<qint64>(lengths[last - 1]);
+        progress.append(entry);
+    }
+
+    PhaseSamples total;
+    for(double latency : latencies) {
+        total.add(latency);
+    }
+
+    QJsonObject result;
+    result["appends"] = static_cast<qint64>(chunks.size());
+    result["characters"] = static_cast<qint64>(characters);
+    result["fragments"] = static_cast<qint64>(label.fragmentCount());
+    result["latency"] = total.toJson();
+    result["phases"] = phases;
+    result["progress"] = progress;
+    if(interval > 0) {
+        QJsonObject schedule;
+        schedule["rate"] = options.rate;
+        schedule["interval_ms"] = interval;
+        schedule["appends_behind"] = behind; // started more than one interval after their chunk arrived
+        schedule["max_lag_ms"] = max_lag;
+        schedule["final_lag_ms"] = lag;
+        schedule["keeps_up"] = behind == 0;
+        result["schedule"] = schedule;
+    }
+    return result;
+}
+
+int main(int argc, char* argv[]){
+    useOffscreenPlatform();
+    QApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Replays a chunk stream through LatexLabel::appendText and reports the latency of every append as JSON.");
+    parser.addHelpOption();
+    QCommandLineOption chunksOption("chunks", "Recorded stream, a JSON array of chunk strings.", "file");
+    QCommandLineOption fileOption("file", "Markdown file streamed in chunks of --words-per-chunk words.", "file");
+    QCommandLineOption generateOption("generate", "Stream a generated document of this scale.", "factor", "1");
+    QCommandLineOption chunkOption("words-per-chunk", "Words per chunk for --file and --generate.", "n", "1");
+    QCommandLineOption rateOption("rate", "Chunks per second, 0 for as fast as possible.", "n", "0");
+    QCommandLineOption widthOption("width", "Layout width in pixels.", "px", "800");
+    QCommandLineOption viewportOption("viewport-height", "Height of the area repainted after each append.", "px", "600");
+    QCommandLineOption syncOption("sync-latex", "Build formulas inside appendText instead of on the worker.");
+    QCommandLineOption outputOption("output", "Write the report to a file instead of stdout.", "file");
+    for(const QCommandLineOption& option : {chunksOption, fileOption, generateOption, chunkOption, rateOption, widthOption, viewportOption, syncOption, outputOption}) {
+        parser.addOption(option);
+    }
+    parser.process(app);
+
+    replay_options options;
+    options.rate = std::max(0.0, parser.value(rateOption).toDouble());
+    options.width = std::max(100, parser.value(widthOption).toInt());
+    options.viewport_height = std::max(1, parser.value(viewportOption).toInt());
+    options.async_latex = !parser.isSet(syncOption);
+    int words_per_chunk = std::max(1, parser.value(chunkOption).toInt());
+
+    QString source;
+    QStringList chunks;
+    if(parser.isSet(chunksOption)) {
+        source = parser.value(chunksOption);
+        chunks = read_chunk_file(source);
+    }
+    else if(parser.isSet(fileOption)) {
+        source = parser.value(fileOption);
+        chunks = splitIntoChunks(readTextFile(source), words_per_chunk);
+    }
+    else {
+        double factor = std::max(0.01, parser.value(generateOption).toDouble());
+        source = QString("generated x%1").arg(factor);
+        chunks = splitIntoChunks(generateDocument(document_params().scaled(factor)), words_per_chunk);
+    }
+    if(chunks.isEmpty()) {
+        std::fprintf(stderr, "Nothing to replay from %s\n", qPrintable(source));
+        return 1;
+    }
+
+    initMicroTeX();
+    QJsonObject report = replay(chunks, options);
+    report["source"] = source;
+    report["platform"] = QGuiApplication::platformName();
+    report["allocations_counted"] = allocationCounter(); // what the allocation figures include
+    report["width"] = options.width;
+    report["async_latex"] = options.async_latex;
+    writeJson(report, parser.value(outputOption));
+    releaseMicroTeX();
+    return 0;
+}
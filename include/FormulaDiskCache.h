@@ -0,0 +1,91 @@
+#pragma once
+
+#include <QHash>
+#include <QImage>
+#include <QMutex>
+#include <QString>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include "render.h"
+
+// A formula as it was laid out and rasterized in an earlier run
+struct stored_formula{
+    int width = 0;
+    int height = 0;
+    int depth = 0;
+    QImage mask; // Format_Alpha8 coverage with FormulaImageCache::padding around the box, tinted when painted
+    std::shared_ptr<const void> mapping; // keeps the file mapped while mask points into it
+};
+
+struct formula_disk_cache_stats{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t writes = 0;
+    size_t entries = 0; // records in the file, including the ones written by this run
+    size_t file_bytes = 0;
+};
+
+// Optional persistent cache of built formulas, so reopening a document lays out
+// and paints its formulas without building a TeXRender for any of them. Records
+// are keyed by a hash of the source, inline or display, text size, device pixel
+// ratio and the MicroTeX resource version, and hold the formula's metrics and an
+// alpha mask. The mask doesn't depend on the text color, it is tinted on paint.
+//
+// The file is append-only and mapped when opened, records written during a run
+// are kept in memory and show up in the mapping on the next open. A file written
+// for other resources or with a truncated tail is reset or cut, never trusted.
+// One process writes a file at a time.
+class FormulaDiskCache{
+public:
+    static constexpr uint32_t format_version = 1;
+
+    static FormulaDiskCache& instance();
+    static QString defaultResourceVersion(); // the MicroTeX revision the library was built against
+
+    bool open(const QString& path, const QString& resource_version = defaultResourceVersion());
+    void close(); // masks already handed out stay valid
+    bool isOpen() const;
+
+    // nullptr if the formula was never stored or the cache isn't open
+    std::shared_ptr<const stored_formula> find(const QString& latex, bool isInline, int text_size, qreal device_pixel_ratio);
+    // Rasterizes render and appends it, formulas that set their own colors are skipped
+    void insert(const QString& latex, bool isInline, int text_size, qreal device_pixel_ratio, tex::TeXRender& render);
+    bool flush();
+
+    void setMaxFileBytes(size_t bytes); // stops appending past this size
+    size_t maxFileBytes() const;
+    formula_disk_cache_stats stats() const;
+    void resetStats();
+
+private:
+    FormulaDiskCache() = default;
+    ~FormulaDiskCache();
+
+    struct mapped_file;
+
+    uint64_t keyHash(const QByteArray& source, bool isInline, int text_size, qreal device_pixel_ratio) const;
+    bool readIndex(); // caller holds m_mutex
+    std::shared_ptr<const stored_formula> load(qint64 offset, const QByteArray& source, bool isInline, int text_size, qreal device_pixel_ratio) const; // caller holds m_mutex
+
+    mutable QMutex m_mutex;
+    std::shared_ptr<mapped_file> m_file;
+    uint64_t m_resource_hash = 0;
+    QHash<uint64_t, qint64> m_index; // key hash to record offset in the mapping
+    // Found or written this run, handed out as the same pointer. The key is kept
+    // with it, a hash collision must not hand out another formula.
+    struct loaded_formula{
+        QByteArray source;
+        bool is_inline = false;
+        int text_size = 0;
+        int ratio = 0; // device pixel ratio in hundredths
+        std::shared_ptr<const stored_formula> formula;
+    };
+    QHash<uint64_t, loaded_formula> m_loaded;
+    size_t m_file_bytes = 0;
+    size_t m_appended = 0; // records written by this run, not in m_index
+    size_t m_max_file_bytes = 256 * 1024 * 1024;
+    uint64_t m_hits = 0;
+    uint64_t m_misses = 0;
+    uint64_t m_writes = 0;
+};
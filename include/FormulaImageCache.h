@@ -0,0 +1,80 @@
+#pragma once
+
+#include <QColor>
+#include <QHash>
+#include <QImage>
+#include <QMutex>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include "render.h"
+
+struct stored_formula;
+
+struct formula_image_key{
+    const void* source; // the render or stored formula the image was made from
+    qreal device_pixel_ratio;
+    QRgb color;
+
+    bool operator==(const formula_image_key& other) const = default;
+};
+size_t qHash(const formula_image_key& key, size_t seed = 0);
+
+struct formula_image_stats{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+    size_t byte_budget = 0;
+};
+
+// Process-wide cache of built formulas rasterized once, so painting blits an
+// image instead of walking the box tree. Entries only hold a weak reference
+// to what they were made from, an address that got reused after it was freed
+// is a miss. Images rather than pixmaps so tiles painted on worker threads can use
+// them too.
+class FormulaImageCache{
+public:
+    static constexpr int padding = 2; // around the render, antialiasing may draw past its box
+
+    static FormulaImageCache& instance();
+
+    // The formula at the painter's device pixel ratio, drawn at its box's top-left minus padding
+    QImage image(const std::shared_ptr<tex::TeXRender>& render, qreal device_pixel_ratio, QRgb color);
+    // A formula from the disk cache, its mask tinted at the ratio it was stored with
+    QImage image(const std::shared_ptr<const stored_formula>& formula, QRgb color);
+    void purge(); // drops the images of renders and formulas that were freed
+
+    void setByteBudget(size_t bytes);
+    size_t byteBudget() const;
+    formula_image_stats stats() const;
+    void resetStats();
+    void clear();
+
+private:
+    FormulaImageCache() = default;
+
+    struct cache_entry{
+        formula_image_key key;
+        std::weak_ptr<const void> source;
+        QImage image;
+        size_t bytes;
+    };
+
+    static QImage rasterize(tex::TeXRender& render, qreal device_pixel_ratio, QRgb color);
+    static QImage tint(const stored_formula& formula, QRgb color);
+    template<typename Source, typename Paint>
+    QImage cached(const std::shared_ptr<Source>& source, qreal device_pixel_ratio, QRgb color, Paint paint);
+    void evict(); // caller holds m_mutex
+
+    mutable QMutex m_mutex;
+    std::list<cache_entry> m_lru; // most recently painted first
+    QHash<formula_image_key, std::list<cache_entry>::iterator> m_entries;
+    size_t m_bytes = 0;
+    size_t m_byte_budget = 32 * 1024 * 1024;
+    uint64_t m_hits = 0;
+    uint64_t m_misses = 0;
+    uint64_t m_evictions = 0;
+};
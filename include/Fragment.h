@@ -2,21 +2,29 @@
 
 #include <QWidget>
 #include <QString>
+#include <QStringView>
 #include <QRect>
 #include <QPoint>
 #include <QFont>
 #include <QPalette>
+#include <QStaticText>
 #include <QDebug>
 #include <cstdint>
 #include <iostream>
+#include <memory>
+#include <optional>
+#include <vector>
 #include "latex.h"
 
+struct stored_formula;
+
 enum class fragment_type{
     latex,
     text,
     line,
     rounded_rect,
-    clipped_text
+    code_lines,
+    button
 };
 
 enum class font_type{
@@ -36,14 +44,14 @@ enum class font_type{
     heading6
 };
 
+// Payloads live in per-type tables of DisplayList, text is stored as a range
+// of its shared character buffer.
 struct frag_text_data{
-    QString text;
-    QFont font;
+    qsizetype offset;
+    qsizetype length;
+    uint8_t style; // font_type, resolved through the label's StyleTable
     QPalette::ColorRole color;
-
-    // Constructor with color
-    frag_text_data(QString t, QFont f, QPalette::ColorRole c = QPalette::Text)
-        : text(t), font(f), color(c) {}
+    mutable std::optional<QStaticText> glyphs; // the run shaped once, filled the first time it is painted
 };
 
 struct frag_line_data{
@@ -70,251 +78,84 @@ struct frag_rrect_data{
 };
 
 struct frag_latex_data{
-    tex::TeXRender* render;
+    std::shared_ptr<tex::TeXRender> render;
     QString text;
     bool isInline;
+    std::shared_ptr<const stored_formula> stored; // painted when there is no render
 };
-struct clipped_text_data{
-    QRect clipArea;
-    QString text;
-    uint8_t codeBlock_id;
+// The text area of a code block, its lines are drawn from the block's line
+// index when painted, only the ones the exposed area covers. The bounding box
+// is the clip, the first line's top is the box's top.
+struct frag_code_data{
+    int text_x; // left of the text before the block's horizontal scroll
+    uint32_t codeBlock_id;
+};
+
+// Copy button of a code block, hover and press state come from the label
+struct frag_button_data{
+    uint32_t codeBlock_id;
 };
 
+// Plain value, data indexes the table of DisplayList that matches type
 typedef struct Fragment{
     QRect bounding_box;
     fragment_type type;
     bool is_highlighted;
-    void* data;
-
-    Fragment(QRect bounding_box,QString text, QFont font, QPalette::ColorRole color = QPalette::Text):bounding_box(bounding_box),is_highlighted(false),type(fragment_type::text){
-        //text constructor
-        data = new frag_text_data(text,font,color);
-    }
-    Fragment(QRect bounding_box, QRect rect,int radius,QPalette::ColorRole bg, QPalette::ColorRole stroke = QPalette::WindowText):bounding_box(bounding_box),is_highlighted(false),type(fragment_type::rounded_rect){
-        //rounded rect constructor
-        data = new frag_rrect_data(rect,radius,bg,stroke);
-    }
-    Fragment(QRect bounding_box, QRect rect, qreal tl, qreal tr, qreal bl, qreal br, QPalette::ColorRole bg, QPalette::ColorRole stroke = QPalette::WindowText):bounding_box(bounding_box),is_highlighted(false),type(fragment_type::rounded_rect){
-        //rounded rect constructor with individual corner radii
-        data = new frag_rrect_data(rect,tl,tr,bl,br,bg,stroke);
-    }
-    Fragment(QRect bounding_box, QPoint to, int width = 1): bounding_box(bounding_box),is_highlighted(false), type(fragment_type::line){
-        //line constructor
-        data = new frag_line_data(to,width);
-    }
-    Fragment(QRect bounding_box, tex::TeXRender* render, QString text, bool isInline): bounding_box(bounding_box),is_highlighted(false), type(fragment_type::latex){
-        data = new frag_latex_data(render,text,isInline);
-    }
-    Fragment(QRect clip_area,QRect bounding, QString& text,int id) : bounding_box(bounding),is_highlighted(false),type(fragment_type::clipped_text){
-        //clipped text constructor
-
-        data = new clipped_text_data(clip_area, text,id);
-    }
-
-    //Stream operator for easy printing with QDebug
-    friend QDebug operator<<(QDebug debug, const Fragment& fragment) {
-        QString result = QString("Fragment{");
-        result += QString("type: ");
-
-        switch(fragment.type) {
-            case fragment_type::text:
-                result += "text";
-                break;
-            case fragment_type::latex:
-                result += "latex";
-                break;
-            case fragment_type::line:
-                result += "line";
-                break;
-            case fragment_type::rounded_rect:
-                result += "rounded_rect";
-                break;
-            case fragment_type::clipped_text:
-                result += "clipped_text";
-                break;
-        }
-
-        result += QString(", bounding_box: (%1,%2,%3,%4)")
-                    .arg(fragment.bounding_box.x())
-                    .arg(fragment.bounding_box.y())
-                    .arg(fragment.bounding_box.width())
-                    .arg(fragment.bounding_box.height());
+    uint32_t data;
 
-        result += QString(", highlighted: %1").arg(fragment.is_highlighted ? "true" : "false");
-
-        //Add type-specific data
-        switch(fragment.type) {
-            case fragment_type::text: {
-                frag_text_data* text_data = (frag_text_data*)fragment.data;
-                QString text_content = text_data->text;
-                if(text_content.length() > 50) {
-                    text_content = text_content.left(47) + "...";
-                }
-                text_content = text_content.replace('\n', "\\n").replace('\t', "\\t");
-                result += QString(", text: \"%1\"").arg(text_content);
-                result += QString(", font: %1 %2pt").arg(text_data->font.family()).arg(text_data->font.pointSize());
-                result += QString(", color: %1").arg(text_data->color);
-                break;
-            }
-            case fragment_type::latex: {
-                frag_latex_data* latex_data = (frag_latex_data*)fragment.data;
-                QString latex_text = latex_data->text;
-                if(latex_text.length() > 50) {
-                    latex_text = latex_text.left(47) + "...";
-                }
-                result += QString(", latex: \"%1\"").arg(latex_text);
-                result += QString(", inline: %1").arg(latex_data->isInline ? "true" : "false");
-                if(latex_data->render) {
-                    result += QString(", render_size: %1x%2")
-                                .arg(latex_data->render->getWidth())
-                                .arg(latex_data->render->getHeight());
-                }
-                break;
-            }
-            case fragment_type::line: {
-                frag_line_data* line_data = (frag_line_data*)fragment.data;
-                result += QString(", to: (%1,%2)").arg(line_data->to.x()).arg(line_data->to.y());
-                result += QString(", width: %1").arg(line_data->width);
-                break;
-            }
-            case fragment_type::rounded_rect: {
-                frag_rrect_data* rect_data = (frag_rrect_data*)fragment.data;
-                result += QString(", rect: (%1,%2,%3,%4)")
-                            .arg(rect_data->rect.x())
-                            .arg(rect_data->rect.y())
-                            .arg(rect_data->rect.width())
-                            .arg(rect_data->rect.height());
-                result += QString(", radii: (tl:%1,tr:%2,bl:%3,br:%4)")
-                            .arg(rect_data->topLeftRadius)
-                            .arg(rect_data->topRightRadius)
-                            .arg(rect_data->bottomLeftRadius)
-                            .arg(rect_data->bottomRightRadius);
-                result += QString(", bg: %1, stroke: %2").arg(rect_data->background).arg(rect_data->stroke);
-                break;
-            }
-            case fragment_type::clipped_text: {
-                clipped_text_data* clip_data = (clipped_text_data*)fragment.data;
-                QString clip_text = clip_data->text;
-                if(clip_text.length() > 50) {
-                    clip_text = clip_text.left(47) + "...";
-                }
-                clip_text = clip_text.replace('\n', "\\n").replace('\t', "\\t");
-                result += QString(", text: \"%1\"").arg(clip_text);
-
-                result += QString(", clip_area: (%1,%2,%3,%4)")
-                            .arg(clip_data->clipArea.x())
-                            .arg(clip_data->clipArea.y())
-                            .arg(clip_data->clipArea.width())
-                            .arg(clip_data->clipArea.height());
-                break;
-            }
-        }
-
-        result += "}";
-        debug.noquote() << result;
-        return debug;
-    }
+    //Stream operator for easy printing with QDebug, see DisplayList::describe for the payload
+    friend QDebug operator<<(QDebug debug, const Fragment& fragment);
 }Fragment;
 
-//Stream operator for standard C++ streams
-inline std::ostream& operator<<(std::ostream& os, const Fragment& fragment) {
-    QString result = QString("Fragment{");
-    result += QString("type: ");
-
-    switch(fragment.type) {
-        case fragment_type::text:
-            result += "text";
-            break;
-        case fragment_type::latex:
-            result += "latex";
-            break;
-        case fragment_type::line:
-            result += "line";
-            break;
-        case fragment_type::rounded_rect:
-            result += "rounded_rect";
-            break;
-        case fragment_type::clipped_text:
-            result += "clipped_text";
-            break;
-    }
-
-    result += QString(", bounding_box: (%1,%2,%3,%4)")
-                .arg(fragment.bounding_box.x())
-                .arg(fragment.bounding_box.y())
-                .arg(fragment.bounding_box.width())
-                .arg(fragment.bounding_box.height());
-
-    result += QString(", highlighted: %1").arg(fragment.is_highlighted ? "true" : "false");
-
-    //Add type-specific data
-    switch(fragment.type) {
-        case fragment_type::text: {
-            frag_text_data* text_data = (frag_text_data*)fragment.data;
-            QString text_content = text_data->text;
-            if(text_content.length() > 50) {
-                text_content = text_content.left(47) + "...";
-            }
-            text_content = text_content.replace('\n', "\\n").replace('\t', "\\t");
-            result += QString(", text: \"%1\"").arg(text_content);
-            result += QString(", font: %1 %2pt").arg(text_data->font.family()).arg(text_data->font.pointSize());
-            result += QString(", color: %1").arg(text_data->color);
-            break;
-        }
-        case fragment_type::latex: {
-            frag_latex_data* latex_data = (frag_latex_data*)fragment.data;
-            QString latex_text = latex_data->text;
-            if(latex_text.length() > 50) {
-                latex_text = latex_text.left(47) + "...";
-            }
-            result += QString(", latex: \"%1\"").arg(latex_text);
-            result += QString(", inline: %1").arg(latex_data->isInline ? "true" : "false");
-            if(latex_data->render) {
-                result += QString(", render_size: %1x%2")
-                            .arg(latex_data->render->getWidth())
-                            .arg(latex_data->render->getHeight());
-            }
-            break;
-        }
-        case fragment_type::line: {
-            frag_line_data* line_data = (frag_line_data*)fragment.data;
-            result += QString(", to: (%1,%2)").arg(line_data->to.x()).arg(line_data->to.y());
-            result += QString(", width: %1").arg(line_data->width);
-            break;
-        }
-        case fragment_type::rounded_rect: {
-            frag_rrect_data* rect_data = (frag_rrect_data*)fragment.data;
-            result += QString(", rect: (%1,%2,%3,%4)")
-                        .arg(rect_data->rect.x())
-                        .arg(rect_data->rect.y())
-                        .arg(rect_data->rect.width())
-                        .arg(rect_data->rect.height());
-            result += QString(", radii: (tl:%1,tr:%2,bl:%3,br:%4)")
-                        .arg(rect_data->topLeftRadius)
-                        .arg(rect_data->topRightRadius)
-                        .arg(rect_data->bottomLeftRadius)
-                        .arg(rect_data->bottomRightRadius);
-            result += QString(", bg: %1, stroke: %2").arg(rect_data->background).arg(rect_data->stroke);
-            break;
-        }
-        case fragment_type::clipped_text: {
-            clipped_text_data* clip_data = (clipped_text_data*)fragment.data;
-            QString clip_text = clip_data->text;
-            if(clip_text.length() > 50) {
-                clip_text = clip_text.left(47) + "...";
-            }
-            clip_text = clip_text.replace('\n', "\\n").replace('\t', "\\t");
-            result += QString(", text: \"%1\"").arg(clip_text);
-            result += QString(", clip_area: (%1,%2,%3,%4)")
-                        .arg(clip_data->clipArea.x())
-                        .arg(clip_data->clipArea.y())
-                        .arg(clip_data->clipArea.width())
-                        .arg(clip_data->clipArea.height());
-            break;
-        }
-    }
+// The display list as a structure of arrays. Fragments and their payloads are
+// appended to contiguous tables that keep their capacity when truncated, so
+// laying out again allocates nothing once the tables have grown.
+class DisplayList{
+public:
+    size_t size() const { return m_fragments.size(); }
+    bool empty() const { return m_fragments.empty(); }
+    Fragment& operator[](size_t i) { return m_fragments[i]; }
+    const Fragment& operator[](size_t i) const { return m_fragments[i]; }
+    Fragment& back() { return m_fragments.back(); }
+    std::vector<Fragment>::iterator begin() { return m_fragments.begin(); }
+    std::vector<Fragment>::iterator end() { return m_fragments.end(); }
+    std::vector<Fragment>::const_iterator begin() const { return m_fragments.begin(); }
+    std::vector<Fragment>::const_iterator end() const { return m_fragments.end(); }
+
+    void addText(QRect bounding_box, QStringView text, font_type style, QPalette::ColorRole color = QPalette::Text);
+    void addLatex(QRect bounding_box, std::shared_ptr<tex::TeXRender> render, const QString& text, bool isInline, std::shared_ptr<const stored_formula> stored = nullptr);
+    void addLine(QRect bounding_box, QPoint to, int width = 1);
+    void addRoundedRect(QRect bounding_box, const frag_rrect_data& data);
+    void addCodeLines(QRect clip_area, int text_x, int codeBlock_id);
+    void addButton(QRect bounding_box, int codeBlock_id);
+
+    void truncate(size_t from); // drop fragments from index on, tables keep their capacity
+    void clear() { truncate(0); }
+
+    const frag_text_data& text(const Fragment& f) const { return m_texts[f.data]; }
+    const frag_line_data& line(const Fragment& f) const { return m_lines[f.data]; }
+    const frag_rrect_data& roundedRect(const Fragment& f) const { return m_rrects[f.data]; }
+    const frag_latex_data& latex(const Fragment& f) const { return m_latex[f.data]; }
+    const frag_code_data& codeLines(const Fragment& f) const { return m_code[f.data]; }
+    const frag_button_data& button(const Fragment& f) const { return m_buttons[f.data]; }
+
+    // Views into the character buffer, only valid until the next add
+    QStringView chars(const frag_text_data& data) const { return QStringView(m_chars).mid(data.offset, data.length); }
+
+    QString describe(size_t i) const; // debug string of fragment i with its payload
+
+private:
+    qsizetype appendChars(QStringView text);
+
+    std::vector<Fragment> m_fragments;
+    std::vector<frag_text_data> m_texts;
+    std::vector<frag_line_data> m_lines;
+    std::vector<frag_rrect_data> m_rrects;
+    std::vector<frag_latex_data> m_latex;
+    std::vector<frag_code_data> m_code;
+    std::vector<frag_button_data> m_buttons;
+    QString m_chars; // text of all text fragments, back to back
+};
 
-    result += "}";
-    os << result.toStdString();
-    return os;
-}
+//Stream operator for standard C++ streams
+std::ostream& operator<<(std::ostream& os, const Fragment& fragment);
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <QRect>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Vertical band index over m_display_list. Each fragment is listed in every
+// band of band_height pixels its bounding box touches, so a query only visits
+// the bands a rect covers. Horizontal position isn't indexed, callers test the
+// candidates' bounding boxes against their rect or point. A code block is one
+// fragment whose box is its visible clip, its lines and scroll offset are
+// resolved when it is painted.
+class FragmentIndex{
+public:
+    static constexpr int band_height = 128;
+
+    void insert(size_t fragment, const QRect& bounding_box); // fragments are inserted in display list order
+    void truncate(size_t from); // forget fragments from index on, bands above them aren't visited
+    void clear();
+
+    // Fragments whose bands overlap [top, bottom], ascending so paint order is kept
+    void query(int top, int bottom, std::vector<uint32_t>& out) const;
+    // Fragments in the band containing y, ascending
+    const std::vector<uint32_t>& band(int y) const;
+
+private:
+    static int bandOf(int y);
+
+    std::vector<std::vector<uint32_t>> m_bands;
+    std::vector<uint32_t> m_first_band; // per fragment, truncate starts at the topmost band it touches
+    size_t m_fragments = 0;
+};
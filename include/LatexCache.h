@@ -0,0 +1,94 @@
+#pragma once
+
+#include <QString>
+#include <QHash>
+#include <QMutex>
+#include <QColor>
+#include <QObject>
+#include <QThreadPool>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <vector>
+#include "render.h"
+
+// MicroTeX keeps its parser and font tables in process-global state, every
+// build and every draw holds this, on the GUI thread as much as on workers
+QMutex& microtexMutex();
+
+struct latex_cache_key{
+    QString latex;
+    bool isInline;
+    int text_size;
+    QRgb color;
+
+    bool operator==(const latex_cache_key& other) const = default;
+};
+size_t qHash(const latex_cache_key& key, size_t seed = 0);
+
+struct latex_cache_stats{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0; // estimated size of all cached renders
+    size_t byte_budget = 0;
+};
+
+// Process-wide cache of built formulas, shared by all LatexLabel instances.
+// Renders are handed out as shared pointers, evicting an entry only drops the
+// cache's reference. Formulas that fail to parse are cached as nullptr so they
+// aren't rebuilt on every parse either.
+//
+// Formulas can also be built on a worker thread. MicroTeX keeps its parser and
+// font tables in process-global state, so all builds, synchronous or not, are
+// serialized; the worker keeps them off the GUI thread.
+class LatexRenderCache{
+public:
+    static LatexRenderCache& instance();
+
+    std::shared_ptr<tex::TeXRender> get(const QString& latex, bool isInline, int text_size, QRgb argb_color);
+    // Cache lookup without building, found tells a cached failure (nullptr) apart from a miss
+    std::shared_ptr<tex::TeXRender> lookup(const QString& latex, bool isInline, int text_size, QRgb argb_color, bool* found);
+    // Builds the formula on the worker, on_ready is queued to receiver's thread with the render. The
+    // cache may have evicted it again by the time on_ready runs, the render passed along is what counts.
+    void requestAsync(const QString& latex, bool isInline, int text_size, QRgb argb_color, QObject* receiver, std::function<void(std::shared_ptr<tex::TeXRender>)> on_ready);
+    void cancelRequests(QObject* receiver); // call before receiver is destroyed
+    void waitForAsyncBuilds();
+
+    void setByteBudget(size_t bytes); // evicts least recently used entries right away if needed
+    size_t byteBudget() const;
+    latex_cache_stats stats() const;
+    void resetStats();
+    void clear();
+
+private:
+    LatexRenderCache();
+
+    struct cache_entry{
+        latex_cache_key key;
+        std::shared_ptr<tex::TeXRender> render;
+        size_t bytes;
+    };
+
+    struct pending_request{
+        QObject* receiver;
+        std::function<void(std::shared_ptr<tex::TeXRender>)> on_ready;
+    };
+
+    std::shared_ptr<tex::TeXRender> insert(const latex_cache_key& key, std::shared_ptr<tex::TeXRender> render); // caller holds m_mutex
+    void evict(); // caller holds m_mutex
+
+    mutable QMutex m_mutex;
+    std::list<cache_entry> m_lru; // most recently used first
+    QHash<latex_cache_key, std::list<cache_entry>::iterator> m_entries;
+    QHash<latex_cache_key, std::vector<pending_request>> m_pending; // formulas queued on the worker
+    QThreadPool m_pool;
+    size_t m_bytes = 0;
+    size_t m_byte_budget = 32 * 1024 * 1024;
+    uint64_t m_hits = 0;
+    uint64_t m_misses = 0;
+    uint64_t m_evictions = 0;
+};
@@ -12,36 +12,121 @@
 #include <QLabel>
 #include <QScrollArea>
 #include <QToolButton>
-#include <QPushButton>
+#include <QPointer>
+#include <QThreadPool>
+#include <atomic>
 #include <md4c.h>
 #include <vector>
+#include <memory>
 #include "render.h"
 #include "element.h"
+#include "SourceBuffer.h"
 #include "Fragment.h"
+#include "FragmentIndex.h"
+#include "StyleTable.h"
+#include "TileCache.h"
+#include "LatexCache.h"
 
 struct layoutInfoCodeBlock{
-    int shift;
-    bool isOverflowing;
+    int shift=0;
+    bool isOverflowing=false;
     QRect boundingBox;
-    int maxShift;
-    QPushButton* button;
+    int maxShift=0;
+    QRect button; // the painted Copy button, empty while the block is out of view
+    std::vector<source_text> lines; // every line that is drawn, ranges in the source unless md4c made some of it up
+    int max_line_width=0; // widest line, lines are only measured again when the block changes
+    unsigned line_count=1; // lines the block is sized for, its line breaks plus one
+    bool last_line_open=false; // no line break after the last line yet, streaming may extend it
+    uint32_t last_line_child=0; // first child of the last line
+    bool measured=false; // lines and max_line_width are valid for the block and the current fonts
+    // What lines were indexed from, the source only grows at the end within a document
+    uint64_t generation=0;
+    qsizetype source_begin=0;
+    qsizetype source_end=0;
+    uint32_t child_count=0;
+};
+
+// Where a top-level element starts in the layout, so layout can resume from it
+struct segmentLayout{
+    size_t fragments=0; // first fragment in m_display_list
+    int code_blocks=0; // first entry of m_code_block_info
+    qreal x=0;
+    qreal y=0;
+    qreal height=0; // estimated until the element is laid out in virtualized mode
+    int code_block_count=0;
+    bool measured=false;
+};
+
+// Part of the document that stays parsed and laid out while text is appended.
+// Everything after it is the open tail that gets re-parsed on every append.
+struct frozenPrefix{
+    qsizetype text_length=0; // bytes of m_source covered
+    size_t segments=0; // top-level elements in m_segments
+    size_t nodes=0; // elements in m_tree
+    size_t fragments=0; // fragments in m_display_list
+    int code_blocks=0; // entries of m_code_block_info
+    qreal x=0;
+    qreal y=0;
 };
 
 
+// Chunks that went through queueText since the last resetAppendQueueStats
+struct append_queue_stats{
+    uint64_t chunks=0;
+    uint64_t flushes=0; // parses and layouts they were coalesced into
+    uint64_t merged=0; // chunks that didn't get a parse of their own
+    size_t bytes=0;
+};
+
+
+// Time spent in each phase since the last resetTimings, for benchmarks
+struct phase_timings{
+    qint64 parse_ns=0; // md4c and the tree, formulas excluded
+    qint64 latex_ns=0; // formula lookups and synchronous builds
+    qint64 layout_ns=0; // display list
+};
+
+// What painting reads besides the display list, tiles get a copy so they can be painted off the GUI thread
+struct paint_context{
+    const StyleTable* styles;
+    QPalette palette;
+    qsizetype selected;
+    QRect selection;
+    bool gui_thread; // text runs may fill their QStaticText cache
+    int hovered_button; // code block whose Copy button is under the mouse, -1 for none
+    int pressed_button;
+};
+
 // Parser state for md4c callbacks
 struct MarkdownParserState {
-    std::vector<Element*> segments;
-    std::vector<Element*> blockStack;
-    std::vector<Element*> spanStack;
+    ElementTree* tree; // blocks are opened and closed on the tree itself
+    std::vector<size_t> spanStack; // ElementTree::building handles
     QString currentText;
     int textSize;
     int list_nesting_level;
     std::vector<Element> list_type_stack; //track nested list types
+    const std::atomic<uint64_t>* generation=nullptr; // background parses stop once this moves past expected_generation
+    uint64_t expected_generation=0;
+    const char* source=nullptr; // start of the document md4c runs on a part of, spans are stored as offsets from it
+    qsizetype source_size=0;
 
+    MarkdownParserState(ElementTree* tree, int size) : tree(tree), textSize(size), list_nesting_level(0) {}
+    bool cancelled() const { return generation && generation->load(std::memory_order_relaxed) != expected_generation; }
+};
 
-    MarkdownParserState(int size) : textSize(size), list_nesting_level(0) {}
+// A document parsed on the worker. Nothing else touches it until it is
+// swapped in whole on the GUI thread, the text it was parsed from stays on
+// screen until then. Formulas are requested after the swap.
+struct document_snapshot{
+    uint64_t generation=0; // setText it was parsed for
+    SourceBuffer source; // shares the label's bytes
+    ElementTree tree;
+    std::vector<uint32_t> segments;
+    frozenPrefix frozen; // text_length, segments and nodes, layout fills in the rest
+    qint64 parse_ns=0;
 };
-tex::TeXRender* getLatexRenderer(const QString& latex, bool isInline, int text_size, QRgb argb_color);
+// Looks the formula up in LatexRenderCache, building it on a miss. nullptr if it fails to parse.
+std::shared_ptr<tex::TeXRender> getLatexRenderer(const QString& latex, bool isInline, int text_size, QRgb argb_color);
 
 
 class LatexLabel : public QWidget{
@@ -49,53 +134,153 @@ class LatexLabel : public QWidget{
 public:
     void appendText(MD_TEXTTYPE type, QString& text);
     void appendText(QString& text); // Legacy overload for backward compatibility
+    void appendUtf8(QByteArrayView utf8); // appends to the document's source as is, nothing before it is converted again
+    // Streaming: the chunk joins the source right away, what was queued within
+    // one append interval is parsed and laid out once
+    void queueText(const QString& text);
+    void queueUtf8(QByteArrayView utf8);
+    void flushQueuedText(); // parses what is queued now, for the end of a stream
+    void setAppendInterval(int msecs); // 16 by default, about a frame
+    int appendInterval() const;
+    append_queue_stats appendQueueStats() const;
+    void resetAppendQueueStats();
     void appendBlock(MD_BLOCKTYPE type, std::string data);
     void appendSpan(MD_SPANTYPE type, std::string data);
     void setText(QString text);
+    bool setFile(const QString& path); // maps the UTF-8 file and parses it in place, false if it can't be read
     void setTextSize(int size);
     int getTextSize() const;
+    void relayout(int width); // rebuild the display list from the parsed document, no md4c or MicroTeX work
+    void setAsyncLatex(bool enabled); // build formulas on a worker thread and lay out placeholders meanwhile, on by default
+    bool asyncLatex() const;
+    void setFontFamily(const QString& family); // prose, "Arial" by default
+    QString fontFamily() const;
+    void setCodeFontFamily(const QString& family); // code spans and blocks, "Monaco" by default
+    QString codeFontFamily() const;
+    word_advance_stats wordAdvanceStats() const; // memoized word widths used by layout
+    void resetWordAdvanceStats();
+    void setWordAdvanceCacheCapacity(size_t entries);
+    phase_timings timings() const;
+    void resetTimings();
+    size_t fragmentCount() const;
+    void setTileCaching(bool enabled); // paint from cached raster tiles, off by default
+    bool tileCaching() const;
+    tile_cache_stats tileCacheStats() const;
+    void setTileThreads(int threads); // workers rasterizing missing tiles, 0 for one per core, 1 paints them on the GUI thread
+    int tileThreads() const;
+    void setVirtualized(bool enabled); // only lay out the blocks near the parent's visible area, off by default
+    bool virtualized() const;
+    void setBackgroundParsing(bool enabled); // setText parses large texts on a worker, on by default
+    bool backgroundParsing() const;
+    void setBackgroundParseThreshold(qsizetype bytes); // smaller texts are parsed right away, 64k of UTF-8 by default
+    bool parsePending() const; // a background parse hasn't been swapped in yet
+    void waitForParsing(); // blocks until a pending parse is done and swaps it in
     QSize sizeHint() const override;
     LatexLabel(QWidget* parent=nullptr);
     ~LatexLabel();
 
     //Debug method to print m_segments structure
     void printSegmentsStructure() const;
+    QString segmentsStructure() const; // what printSegmentsStructure prints
 
 
 private:
     QPalette m_pallete = QGuiApplication::palette();
-    std::vector<Fragment> m_display_list;
+    DisplayList m_display_list;
+    FragmentIndex m_fragment_index; // kept in sync with m_display_list by the add helpers and deleteDisplayList
     tex::TeXRender* _render;
-    QString m_text;
-    QString m_raw_text; //without markdown formatting
-    std::vector<Element*> m_segments;
+    SourceBuffer m_source; // the document, spans refer to it by offset
+    SourceBuffer m_shown_source; // what m_tree refers to while a background parse of m_source is pending
+    ElementTree m_tree; // the parsed document
+    std::vector<uint32_t> m_segments; // top-level elements, indices into m_tree
     int m_textSize;
+    QString m_font_family="Arial";
+    QString m_code_font_family="Monaco";
+    StyleTable m_styles; // rebuilt whenever size or family change
+    uint64_t m_style_generation=0; // unique per rebuild of m_styles across labels, tile workers rebuild their copy when it changes
     double m_leading=3.0;
-    Fragment* m_selected=nullptr;
+    qsizetype m_selected=-1; // index into m_display_list
+    qsizetype m_selected_offset=0; // word of a text run that is selected
+    qsizetype m_selected_length=-1; // -1 selects the whole fragment
 
     int m_curr_code_block=0;
     std::vector<layoutInfoCodeBlock> m_code_block_info;
+    int m_hovered_button=-1; // code block whose Copy button is under the mouse
+    int m_pressed_button=-1; // code block whose Copy button is held down
+    std::vector<segmentLayout> m_segment_layout; // one per entry of m_segments
+    frozenPrefix m_frozen;
+    bool m_async_latex=true;
+    bool m_latex_refresh_scheduled=false;
+    QHash<latex_cache_key, std::shared_ptr<tex::TeXRender>> m_finished_latex; // built on the worker, held until applyFinishedLatex picks them up
+    bool m_append_flush_scheduled=false;
+    int m_append_interval=16;
+    size_t m_queued_chunks=0; // in m_source but not parsed yet
+    append_queue_stats m_append_stats;
+    phase_timings m_timings;
+    bool m_tile_caching=false;
+    TileCache m_tiles; // dropped per tile by the add helpers, deleteDisplayList and invalidateArea
+    int m_tile_threads=0;
+    QThreadPool m_tile_pool;
+    bool m_background_parsing=true;
+    qsizetype m_background_parse_threshold=64*1024; // UTF-8 bytes of m_source
+    bool m_parse_pending=false; // the document on screen is older than m_source
+    std::atomic<uint64_t> m_parse_generation{0}; // bumped by setText, older background parses give up
+    QThreadPool m_parse_pool;
+    bool m_virtualized=false;
+    bool m_realizing=false;
+    size_t m_realized_first=0; // segments that have fragments in virtualized mode
+    size_t m_realized_last=0;
+    int m_realize_margin=600; // pixels laid out above and below the viewport
+    QPointer<QWidget> m_watched_viewport;
 
     int margin_left=5, margin_right=5,margin_top=5,margin_bottom=5;
 
 
     //void parseText();
-    void parseMarkdown(const QString& text);
+    void parseMarkdown(); // full parse of m_source
+    void parseTail(); // re-parse m_source after the frozen prefix
+    // appends the chunk's top-level elements to m_segments, splits are block boundaries in text it may be parsed at in parallel
+    bool parseChunk(QByteArrayView text, std::span<const qsizetype> splits = {});
+    // md4c into tree without touching the label, safe on any thread. Returns md4c's result.
+    static int parseInto(QByteArrayView text, MarkdownParserState& state, std::vector<uint32_t>& segments);
+    // parseInto, cut at splits into pieces md4c parses on every core and stitched back in order
+    static int parseParallel(QByteArrayView text, std::span<const qsizetype> splits, MarkdownParserState& state, std::vector<uint32_t>& segments);
+    static bool parseSnapshot(document_snapshot& snapshot, const std::atomic<uint64_t>* generation); // false if cancelled
+    void startBackgroundParse();
+    void applySnapshot(const std::shared_ptr<document_snapshot>& snapshot);
+    void resetDocumentState(); // code block and button state of the document being replaced
+    QString sourceText(const source_text& text) const; // of the document m_tree was parsed from
+    void setSource(SourceBuffer source); // replaces the document, parsing it now or on the worker
+    void layoutSegments(size_t first, size_t last, qreal& x, qreal& y, qreal max_x);
+    QPointF layoutOrigin() const; // baseline position of the first line
+    void relayoutFrom(size_t first); // lay out m_segments[first..] again, keeps the fragments before it
+
+    // Virtualized layout
+    qreal estimateHeight(const Element& block, qreal width, int& code_blocks) const; // no text is shaped
+    void estimateSegments(size_t first); // estimates for the segments from first on that weren't laid out
+    void updatePositions(size_t first); // stack the segments from first on by their heights
+    size_t segmentAt(qreal y) const;
+    QRect viewportRect() const; // part of the widget the parent shows
+    QAbstractScrollArea* scrollArea() const;
+    void realizeViewport(bool force); // lay out the segments around the viewport, keeps the top one in place on screen
 
     // Markdown rendering helpers
     void renderBlock(const Element& segment, qreal& x, qreal& y, qreal min_x,qreal max_x, qreal& lineHeight);
-    void renderSpan(const Element& segment, qreal& x, qreal& y, qreal min_x,qreal max_x, qreal lineHeight, QFont* font_passed=nullptr);
+    void renderSpan(const Element& segment, qreal& x, qreal& y, qreal min_x,qreal max_x, qreal lineHeight, const font_type* style_passed=nullptr);
     void renderListElement(const Element& segment, qreal& x, qreal& y, int min_x,int max_x, qreal& lineHeight);
     void renderHeading(const Element& segment, qreal& x, qreal& y, qreal min_x,qreal max_x, qreal& lineHeight);
     void renderCodeBlock(const Element& segment, qreal& x, qreal& y, qreal min_x,qreal max_x, qreal& lineHeight);
+    // text, line index and widest line of a code block, only built again when its source grew or the fonts changed
+    QString codeBlockText(const layoutInfoCodeBlock& info) const; // what Copy puts on the clipboard
+    void indexCodeLines(layoutInfoCodeBlock& info, const Element& segment, const QFontMetrics& metrics);
+    void rebuildStyles(); // after a text size or family change, code lines are measured again
     void renderBlockquote(const Element& segment, qreal& x, qreal& y, qreal min_x,qreal max_x, qreal& lineHeight);
     void renderTextSegment(const Element* segment, qreal& x, qreal& y, qreal min_x,qreal max_x, qreal lineHeight);
     void renderTable(const Element& segment, qreal& x, qreal& y, qreal min_x, qreal max_x, qreal& lineHeight);
     void calculate_table_dimensions(const Element& segment, int* max_width_of_col, int* max_height_of_row, int columns, int rows, qreal min_x, qreal max_x);
 
     // Font and styling helpers
-    QFont getFont(const Element* segment) const;
-    QFont getFont(font_type type) const;
+    const textStyle& textStyleOf(const Element* segment) const;
     qreal getLineHeight(const Element& segment, const QFontMetricsF& metrics) const;
 
     // md4c callback functions
@@ -107,20 +292,44 @@ private:
 
 
     // Debug helper method
-    void printSegmentRecursive(const Element* element, int depth) const;
+    void appendSegmentStructure(QString& out, const Element* element, int depth) const;
+
+    // Swap in renders for the current text size and color from the cache
+    void refreshLatexRenders(QRgb argb_color);
+    void requestLatex(latex_data& data, QRgb argb_color); // sets the render, or marks it pending and queues a build
+    bool resolvePendingLatex(Element& element); // picks up finished builds, true if any did
+    void scheduleLatexRefresh();
+    void applyFinishedLatex();
+    void storeLatex(const latex_data& data); // writes a built formula to the disk cache when one is open
+    void latexExtent(const latex_data& data, const QFontMetrics& metrics, int& width, int& height, int& depth) const;
 
-    // Cleanup methods for AST elements
-    void cleanup_segments(std::vector<Element*>& elements);  // free all pointers in AST
-    void deleteDisplayList();
+    // Cleanup methods
+    void deleteDisplayList(size_t from=0);
 
 
     // Fragment creation helper methods for better readability
-    void addText(qreal x, qreal y, qreal width, qreal height, const QString& text, const QFont& font, QPalette::ColorRole color = QPalette::Text);
-    void addLatex(qreal x, qreal y, qreal width, qreal height, tex::TeXRender* render, const QString& text, bool isInline);
+    void addText(qreal x, qreal y, qreal width, qreal height, const QString& text, font_type style, QPalette::ColorRole color = QPalette::Text);
+    void addLatex(qreal x, qreal y, qreal width, qreal height, std::shared_ptr<tex::TeXRender> render, const QString& text, bool isInline, std::shared_ptr<const stored_formula> stored = nullptr);
     void addLine(qreal x, qreal y, qreal width, qreal height, const QPoint& to, int lineWidth = 1);
     void addRoundedRect(qreal x, qreal y, qreal width, qreal height, qreal radius, QPalette::ColorRole bg, QPalette::ColorRole stroke = QPalette::WindowText);
     void addRoundedRect(qreal x, qreal y, qreal width, qreal height, qreal tl, qreal tr, qreal bl, qreal br, QPalette::ColorRole bg, QPalette::ColorRole stroke = QPalette::WindowText);
-    void addClippedText(QRect clip, QRect bounding, QString& text,int shift);
+    void addCodeLines(const QRect& clip, int text_x, int codeBlock_id);
+    void addButton(const QRect& rect, int codeBlock_id);
+    void indexLastFragment();
+    void selectWordAt(int x); // narrows the selected text run to the word at x
+    QRect selectionRect() const;
+    void invalidateArea(const QRect& rect); // repaint rect, dropping the tiles under it
+    void invalidateTiles(const QRect& bounding_box); // drops the tiles a fragment in bounding_box may draw on
+    int paintOverhang() const; // how far a fragment may draw outside its bounding box
+    int codeBlockButtonAt(const QPoint& pos) const; // code block whose Copy button is at pos, -1 for none
+    void setHoveredButton(int codeBlock_id);
+
+    // Painting
+    paint_context paintContext() const;
+    void paintFragments(QPainter& painter, const QRect& area, const paint_context& context);
+    void paintTiles(QPainter& painter, const QRect& area);
+    void rasterizeTiles(int first, int last); // missing tiles around the viewport, in parallel
+    QImage renderTile(int tile, int tile_width, qreal ratio, const paint_context& context);
 
 protected:
     void paintEvent(QPaintEvent* event) override;
@@ -129,7 +338,10 @@ protected:
     void mouseMoveEvent(QMouseEvent* event) override;
     void mouseDoubleClickEvent(QMouseEvent* event) override;
     void mouseReleaseEvent(QMouseEvent* event) override;
+    void leaveEvent(QEvent* event) override;
     void resizeEvent(QResizeEvent* event) override;
+    void moveEvent(QMoveEvent* event) override;
+    bool eventFilter(QObject* watched, QEvent* event) override;
     void keyPressEvent(QKeyEvent* event) override;
     void wheelEvent(QWheelEvent *event) override;
 };
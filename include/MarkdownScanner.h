@@ -0,0 +1,18 @@
+#pragma once
+
+#include <QByteArrayView>
+#include <vector>
+
+// Result of scanning UTF-8 markdown source for top-level block boundaries.
+// A split point is the start of a line that opens a new top-level block after a
+// blank line, outside of code fences, HTML blocks that end at a marker
+// (CommonMark types 1-5) and lists. Text on both sides of a split
+// point parses to the same blocks whether md4c sees it in one piece or in two.
+struct MarkdownSplitScan{
+    std::vector<qsizetype> splits; // ascending byte offsets into the scanned text
+    bool has_reference_definition = false; // link reference definitions resolve across blocks, splitting would break them
+};
+
+// Only lines that are terminated by a newline are taken as split points, so
+// appending more text can never move a split point that was already reported.
+MarkdownSplitScan scanSplitPoints(QByteArrayView text);
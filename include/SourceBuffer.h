@@ -0,0 +1,38 @@
+#pragma once
+
+#include <QByteArray>
+#include <QByteArrayView>
+#include <QString>
+#include <memory>
+
+// Bytes of a SourceBuffer
+struct source_range{
+    qsizetype offset = 0;
+    qsizetype length = 0;
+};
+
+// The UTF-8 text of a document, owned or a read-only mapping of a file. A
+// mapped file is only copied once something is appended to it. Copies share
+// the bytes, and since the buffer only grows at the end, a range taken from it
+// refers to the same text in every later state of it.
+class SourceBuffer{
+public:
+    bool mapFile(const QString& path); // false if the file can't be opened or mapped, the buffer is empty then
+    void assign(QByteArray utf8);
+    void append(QByteArrayView utf8);
+    void clear();
+
+    const char* data() const { return m_bytes.constData(); }
+    qsizetype size() const { return m_bytes.size(); }
+    bool isEmpty() const { return m_bytes.isEmpty(); }
+    bool isMapped() const { return m_mapping != nullptr; }
+    QByteArrayView view() const { return QByteArrayView(m_bytes.constData(), m_bytes.size()); }
+    QByteArrayView view(source_range range) const { return QByteArrayView(m_bytes.constData() + range.offset, range.length); }
+    QString text(source_range range) const { return QString::fromUtf8(m_bytes.constData() + range.offset, range.length); }
+
+private:
+    struct mapped_file;
+
+    QByteArray m_bytes; // raw data over the mapping while mapped
+    std::shared_ptr<const mapped_file> m_mapping;
+};
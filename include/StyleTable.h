@@ -0,0 +1,86 @@
+#pragma once
+
+#include <QFont>
+#include <QFontMetrics>
+#include <QFontMetricsF>
+#include <QString>
+#include <QHash>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "Fragment.h"
+#include "element.h"
+
+// A resolved font_type: the font and the metrics layout keeps asking for
+struct textStyle{
+    QFont font;
+    QFontMetrics metrics;
+    QFontMetricsF metrics_f;
+    int space_advance;
+    int ascent;
+    int height;
+    int line_spacing;
+};
+
+struct word_advance_stats{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0; // entries dropped to stay under capacity
+    size_t entries = 0;
+    size_t capacity = 0;
+};
+
+// Memoized horizontalAdvance of whole words, keyed by style. Bounded with two
+// generations: new entries go to the current one, hits in the old one are
+// moved over, and once the current generation is full the old one is dropped.
+// Recently used words survive, everything else ages out without LRU bookkeeping.
+class WordAdvanceCache{
+public:
+    int advance(const textStyle& style, uint8_t style_id, const QString& word);
+    void clear(); // entries only, the counters keep running
+    void setCapacity(size_t entries);
+    word_advance_stats stats() const;
+    void resetStats();
+
+private:
+    struct word_key{
+        QString word;
+        uint8_t style;
+        bool operator==(const word_key& other) const = default;
+    };
+    friend size_t qHash(const word_key& key, size_t seed){
+        return qHashMulti(seed, key.word, key.style);
+    }
+
+    QHash<word_key, int> m_current;
+    QHash<word_key, int> m_previous;
+    size_t m_capacity = 16384;
+    uint64_t m_hits = 0;
+    uint64_t m_misses = 0;
+    uint64_t m_evictions = 0;
+};
+
+// One textStyle per font_type, built once per text size and font family
+// instead of constructing QFont and QFontMetrics during layout.
+class StyleTable{
+public:
+    StyleTable();
+    StyleTable(int text_size, const QString& family, const QString& code_family);
+
+    void rebuild(int text_size, const QString& family, const QString& code_family);
+    const textStyle& operator[](font_type type) const { return m_styles[static_cast<size_t>(type)]; }
+    const textStyle& operator[](uint8_t id) const { return m_styles[id]; }
+
+    static font_type styleOf(const Element& element); // font_type an element is drawn in
+
+    // Width of a word without trailing space, memoized across layouts
+    int advance(font_type type, const QString& word) { return m_advances.advance((*this)[type], static_cast<uint8_t>(type), word); }
+    WordAdvanceCache& advanceCache() { return m_advances; }
+    const WordAdvanceCache& advanceCache() const { return m_advances; }
+
+private:
+    QFont resolve(font_type type, int text_size, const QString& family, const QString& code_family) const;
+
+    std::vector<textStyle> m_styles;
+    WordAdvanceCache m_advances;
+};
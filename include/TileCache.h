@@ -0,0 +1,62 @@
+#pragma once
+
+#include <QHash>
+#include <QImage>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+
+struct tile_cache_stats{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t tiles = 0;
+    size_t bytes = 0;
+    size_t byte_budget = 0;
+};
+
+// Rasterized horizontal strips of a LatexLabel. Tile i covers the rows
+// [i*tileHeight(), (i+1)*tileHeight()) at the full widget width, painted at the
+// device pixel ratio it is shown with. A tile is dropped whenever anything it
+// covers changes, the least recently painted ones go when over the byte budget.
+class TileCache{
+public:
+    static constexpr int default_tile_height = 256;
+
+    void setTileHeight(int height); // drops all tiles
+    int tileHeight() const { return m_tile_height; }
+    int tileAt(int y) const { return y < 0 ? 0 : y / m_tile_height; }
+    // Tiles are only valid for one width and ratio, drops all of them if either changed
+    void setGeometry(int width, qreal device_pixel_ratio);
+
+    const QImage* find(int tile); // nullptr on a miss
+    bool contains(int tile) const { return m_entries.contains(tile); }
+    const QImage& insert(int tile, QImage image); // the reference stays valid until the tile is dropped
+    void invalidate(int top, int bottom); // drops the tiles overlapping rows [top, bottom]
+    void clear();
+
+    void setByteBudget(size_t bytes);
+    size_t byteBudget() const { return m_byte_budget; }
+    tile_cache_stats stats() const;
+    void resetStats();
+
+private:
+    struct cache_entry{
+        int tile;
+        QImage image;
+        size_t bytes;
+    };
+
+    void evict();
+
+    std::list<cache_entry> m_lru; // most recently painted first
+    QHash<int, std::list<cache_entry>::iterator> m_entries;
+    int m_tile_height = default_tile_height;
+    int m_width = 0;
+    qreal m_device_pixel_ratio = 1.0;
+    size_t m_bytes = 0;
+    size_t m_byte_budget = 64 * 1024 * 1024;
+    uint64_t m_hits = 0;
+    uint64_t m_misses = 0;
+    uint64_t m_evictions = 0;
+};
@@ -6,9 +6,13 @@
 #include <QString>
 #include <latex.h>
 #include <iostream>
+#include <memory>
+#include <span>
+#include <cstdint>
+#include "SourceBuffer.h"
 
-#define BLOCKTYPE(b) *((MD_BLOCKTYPE*)b->subtype)
-#define SPANTYPE(b) *((spantype*)b->subtype)
+#define BLOCKTYPE(b) ((b)->block_type)
+#define SPANTYPE(b) ((b)->span_type)
 
 struct list_data{
     char mark; // mark delimiter if ordered
@@ -23,22 +27,32 @@ struct list_item_data{
 struct heading_data{
     int level;
 };
+// Text of an element, as a range of the document's SourceBuffer
+struct source_text{
+    source_range range;
+    QString literal; // text md4c made up rather than pointed into the source at, used instead of range when not null
+};
+
 struct code_block_data{
-    QString language;
+    source_text language;
 };
 
+struct stored_formula;
+
 struct span_data{
 public:
-    QString text;
+    source_text text;
 };
 struct link_data{
-    QString title;
-    QString url;
+    source_text title;
+    source_text url;
 };
 struct latex_data{
-    tex::TeXRender* render;
-    QString text;
+    std::shared_ptr<tex::TeXRender> render; // shared with the fragments and the render cache
+    source_text text; // converted when the formula is requested
     bool isInline;
+    bool pending = false; // render is being built on the worker, laid out as a placeholder until then
+    std::shared_ptr<const stored_formula> stored; // from the disk cache, used instead of a render
 };
 
 typedef enum DisplayType{
@@ -73,13 +87,57 @@ class Element{
 
 public:
 Element(DisplayType type, ElementData data = {}, spantype span_type =spantype::normal, MD_BLOCKTYPE block_type = MD_BLOCKTYPE::MD_BLOCK_P);
-~Element();
 DisplayType type;
+MD_BLOCKTYPE block_type; // valid for blocks
+spantype span_type; // valid for spans
 ElementData data;
-void* subtype;
-std::vector<Element*> children;
+uint32_t first_child=0; // children are the contiguous run [first_child, first_child+child_count) of the ElementTree
+uint32_t child_count=0;
 
 friend std::ostream& operator<<(std::ostream& os, const Element& element);
 };
 
 std::ostream& operator<<(std::ostream& os, const Element& element);
+
+// Flat storage for the markdown AST of a document. Nodes live in one array and
+// the children of a node are a contiguous run of it, freeing the tree is a
+// truncation of the array.
+//
+// While md4c runs, nodes are built on a stack: the children of every open
+// block sit on top of their parent's siblings. Closing a block moves its
+// children into the node array in one go, so a subtree is always packed
+// before the node that owns it.
+class ElementTree{
+public:
+    const Element& operator[](uint32_t i) const { return m_nodes[i]; }
+    Element& operator[](uint32_t i) { return m_nodes[i]; }
+    std::span<const Element> children(const Element& element) const { return {m_nodes.data() + element.first_child, element.child_count}; }
+    std::span<Element> children(const Element& element) { return {m_nodes.data() + element.first_child, element.child_count}; }
+    std::span<Element> nodes() { return m_nodes; }
+    size_t size() const { return m_nodes.size(); }
+    void truncate(size_t nodes); // drop nodes from index on, keeps the capacity
+    void clear() { truncate(0); }
+
+    // Building
+    size_t addChild(Element element); // appends to the innermost open block, returns a handle for building()
+    void openBlock(Element element); // addChild and make it the innermost open block
+    void closeBlock(); // packs the children of the innermost open block
+    Element& building(size_t handle) { return m_building[handle]; }
+    Element& openBlockElement() { return m_building[m_open.back().node]; }
+    size_t openChildCount() const { return m_building.size() - m_open.back().children; }
+    void dropLastChild(); // of the innermost open block
+    bool hasOpenBlock() const { return !m_open.empty(); }
+    Element finishDocument(); // the closed root, its children are the top-level elements
+    void abandon(size_t nodes); // forget a failed parse, truncating to nodes
+    uint32_t append(ElementTree&& other); // moves other's nodes to the end, returns the index its node 0 now has
+
+private:
+    struct open_block{
+        size_t node; // handle of the block
+        size_t children; // its first child in m_building
+    };
+
+    std::vector<Element> m_nodes;
+    std::vector<Element> m_building;
+    std::vector<open_block> m_open;
+};
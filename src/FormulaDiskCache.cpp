@@ -0,0 +1,346 @@
+#include "FormulaDiskCache.h"
+#include "FormulaImageCache.h"
+#include "LatexCache.h"
+#include "platform/qt/graphic_qt.h"
+#include <QFile>
+#include <QPainter>
+#include <QStringList>
+#include <cmath>
+#include <cstring>
+
+#ifndef LATEXLABEL_MICROTEX_REVISION
+#define LATEXLABEL_MICROTEX_REVISION "unknown"
+#endif
+
+namespace {
+
+struct file_header{
+    char magic[8];
+    uint32_t format_version;
+    uint32_t reserved;
+    uint64_t resource_hash;
+};
+
+// Followed by the UTF-8 source and the mask rows, each padded to 8 bytes
+struct record_header{
+    uint64_t key_hash;
+    uint32_t record_bytes;
+    uint32_t source_bytes;
+    int32_t width;
+    int32_t height;
+    int32_t depth;
+    uint16_t text_size;
+    uint8_t is_inline;
+    uint8_t reserved;
+    float device_pixel_ratio;
+    uint32_t mask_width;
+    uint32_t mask_height;
+    uint32_t mask_bytes_per_line;
+};
+
+constexpr char file_magic[8] = {'L', 'L', 'F', 'O', 'R', 'M', 'L', 'A'};
+
+qint64 padded(qint64 bytes){
+    return (bytes + 7) & ~qint64(7);
+}
+
+// FNV-1a, qHash is seeded per process and can't key a file
+uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 14695981039346656037ull){
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for(size_t i = 0; i < size; i++){
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Whether the source uses a command that picks its own colors, matched as whole
+// command names so \text{colorful} is still cached
+bool sets_colors(const QString& latex){
+    static const QStringList commands = {"color", "textcolor", "colorbox", "fcolorbox"};
+    for(qsizetype i = 0; i + 1 < latex.size(); i++){
+        if(latex[i] != '\\') continue;
+        qsizetype end = i + 1;
+        while(end < latex.size() && latex[end].isLetter()) end++;
+        if(end == i + 1){
+            i++; //an escaped character, \\ included
+            continue;
+        }
+        if(commands.contains(latex.mid(i + 1, end - i - 1))) return true;
+        i = end - 1;
+    }
+    return false;
+}
+
+// Ratios are compared in hundredths, float noise between runs must not change the key
+int ratio_key(qreal device_pixel_ratio){
+    return qRound(device_pixel_ratio * 100);
+}
+
+}
+
+struct FormulaDiskCache::mapped_file{
+    QFile file;
+    uchar* data = nullptr;
+    qint64 mapped_bytes = 0;
+
+    ~mapped_file(){
+        if(data) file.unmap(data);
+    }
+};
+
+FormulaDiskCache& FormulaDiskCache::instance(){
+    static FormulaDiskCache cache;
+    return cache;
+}
+
+FormulaDiskCache::~FormulaDiskCache(){
+    close();
+}
+
+QString FormulaDiskCache::defaultResourceVersion(){
+    return QString(LATEXLABEL_MICROTEX_REVISION);
+}
+
+uint64_t FormulaDiskCache::keyHash(const QByteArray& source, bool isInline, int text_size, qreal device_pixel_ratio) const{
+    int32_t fields[3] = {isInline ? 1 : 0, text_size, ratio_key(device_pixel_ratio)};
+    uint64_t hash = fnv1a(&m_resource_hash, sizeof(m_resource_hash));
+    hash = fnv1a(fields, sizeof(fields), hash);
+    return fnv1a(source.constData(), source.size(), hash);
+}
+
+bool FormulaDiskCache::open(const QString& path, const QString& resource_version){
+    close();
+    QMutexLocker lock(&m_mutex);
+    QByteArray version = resource_version.toUtf8();
+    m_resource_hash = fnv1a(version.constData(), version.size());
+    m_resource_hash = fnv1a(&format_version, sizeof(format_version), m_resource_hash);
+
+    auto file = std::make_shared<mapped_file>();
+    file->file.setFileName(path);
+    if(!file->file.open(QIODevice::ReadWrite)) return false;
+    m_file = file;
+    if(!readIndex()){
+        //another format or other resources, nothing in it can be used
+        m_index.clear();
+        file_header header{};
+        std::memcpy(header.magic, file_magic, sizeof(file_magic));
+        header.format_version = format_version;
+        header.resource_hash = m_resource_hash;
+        if(!file->file.resize(0) || file->file.write(reinterpret_cast<const char*>(&header), sizeof(header)) != sizeof(header)){
+            m_file.reset();
+            return false;
+        }
+        m_file_bytes = sizeof(header);
+    }
+    return true;
+}
+
+bool FormulaDiskCache::readIndex(){
+    mapped_file& file = *m_file;
+    qint64 size = file.file.size();
+    if(size < static_cast<qint64>(sizeof(file_header))) return false;
+    file.data = file.file.map(0, size);
+    if(!file.data) return false;
+    file.mapped_bytes = size;
+
+    file_header header;
+    std::memcpy(&header, file.data, sizeof(header));
+    if(std::memcmp(header.magic, file_magic, sizeof(file_magic)) != 0 || header.format_version != format_version || header.resource_hash != m_resource_hash){
+        file.file.unmap(file.data);
+        file.data = nullptr;
+        file.mapped_bytes = 0;
+        return false;
+    }
+
+    qint64 offset = sizeof(file_header);
+    while(offset + static_cast<qint64>(sizeof(record_header)) <= size){
+        record_header record;
+        std::memcpy(&record, file.data + offset, sizeof(record));
+        qint64 mask_bytes = qint64(record.mask_bytes_per_line) * record.mask_height;
+        qint64 needed = sizeof(record_header) + padded(record.source_bytes) + padded(mask_bytes);
+        if(record.record_bytes != needed || offset + needed > size || record.mask_bytes_per_line < record.mask_width) break;
+        m_index.insert(record.key_hash, offset);
+        offset += needed;
+    }
+    if(offset < size){
+        //the last write didn't finish, cut it so new records start at a boundary
+        file.file.unmap(file.data);
+        file.data = nullptr;
+        file.mapped_bytes = 0;
+        if(!file.file.resize(offset)) return false;
+        file.data = file.file.map(0, offset);
+        if(!file.data) return false;
+        file.mapped_bytes = offset;
+    }
+    m_file_bytes = offset;
+    return true;
+}
+
+void FormulaDiskCache::close(){
+    QMutexLocker lock(&m_mutex);
+    if(!m_file) return;
+    m_file->file.flush();
+    m_file.reset(); //unmapped once no mask points into it anymore
+    m_index.clear();
+    m_loaded.clear();
+    m_file_bytes = 0;
+    m_appended = 0;
+}
+
+bool FormulaDiskCache::isOpen() const{
+    QMutexLocker lock(&m_mutex);
+    return m_file != nullptr;
+}
+
+std::shared_ptr<const stored_formula> FormulaDiskCache::load(qint64 offset, const QByteArray& source, bool isInline, int text_size, qreal device_pixel_ratio) const{
+    const uchar* data = m_file->data + offset;
+    record_header record;
+    std::memcpy(&record, data, sizeof(record));
+    //a hash collision must not show another formula
+    const char* record_source = reinterpret_cast<const char*>(data + sizeof(record_header));
+    if(record.source_bytes != static_cast<uint32_t>(source.size()) || std::memcmp(record_source, source.constData(), source.size()) != 0) return nullptr;
+    if(record.is_inline != (isInline ? 1 : 0) || record.text_size != text_size || ratio_key(record.device_pixel_ratio) != ratio_key(device_pixel_ratio)) return nullptr;
+
+    auto formula = std::make_shared<stored_formula>();
+    formula->width = record.width;
+    formula->height = record.height;
+    formula->depth = record.depth;
+    const uchar* mask = data + sizeof(record_header) + padded(record.source_bytes);
+    formula->mask = QImage(mask, record.mask_width, record.mask_height, record.mask_bytes_per_line, QImage::Format_Alpha8);
+    formula->mask.setDevicePixelRatio(record.device_pixel_ratio);
+    formula->mapping = m_file;
+    return formula;
+}
+
+std::shared_ptr<const stored_formula> FormulaDiskCache::find(const QString& latex, bool isInline, int text_size, qreal device_pixel_ratio){
+    QMutexLocker lock(&m_mutex);
+    if(!m_file) return nullptr;
+    QByteArray source = latex.toUtf8();
+    uint64_t key = keyHash(source, isInline, text_size, device_pixel_ratio);
+    auto loaded = m_loaded.find(key);
+    if(loaded != m_loaded.end()){
+        const loaded_formula& entry = loaded.value();
+        if(entry.source != source || entry.is_inline != isInline || entry.text_size != text_size || entry.ratio != ratio_key(device_pixel_ratio)){
+            m_misses++; //a hash collision, the slot is taken by another formula
+            return nullptr;
+        }
+        m_hits++;
+        return entry.formula;
+    }
+    auto it = m_index.find(key);
+    std::shared_ptr<const stored_formula> formula;
+    if(it != m_index.end()){
+        formula = load(it.value(), source, isInline, text_size, device_pixel_ratio);
+    }
+    if(!formula){
+        m_misses++;
+        return nullptr;
+    }
+    m_hits++;
+    m_loaded.insert(key, loaded_formula{source, isInline, text_size, ratio_key(device_pixel_ratio), formula});
+    return formula;
+}
+
+void FormulaDiskCache::insert(const QString& latex, bool isInline, int text_size, qreal device_pixel_ratio, tex::TeXRender& render){
+    //colors set in the source would be lost in the mask
+    if(sets_colors(latex)) return;
+    QByteArray source = latex.toUtf8();
+    {
+        QMutexLocker lock(&m_mutex);
+        if(!m_file || m_file_bytes >= m_max_file_bytes) return;
+        uint64_t key = keyHash(source, isInline, text_size, device_pixel_ratio);
+        if(m_loaded.contains(key) || m_index.contains(key)) return;
+    }
+
+    //coverage of the formula drawn with its own foreground, the alpha channel is all that is kept
+    int pad = FormulaImageCache::padding;
+    QSize size(render.getWidth() + 2*pad, render.getHeight() + 2*pad);
+    QImage image(QSize(std::ceil(size.width() * device_pixel_ratio), std::ceil(size.height() * device_pixel_ratio)), QImage::Format_ARGB32_Premultiplied);
+    image.setDevicePixelRatio(device_pixel_ratio);
+    image.fill(Qt::transparent);
+    {
+        QPainter painter(&image);
+        painter.setRenderHint(QPainter::Antialiasing, true);
+        painter.setBrush(QColor(Qt::black));
+        QMutexLocker lock(&microtexMutex());
+        tex::Graphics2D_qt g2(&painter);
+        render.draw(g2, pad, pad);
+    }
+
+    auto formula = std::make_shared<stored_formula>();
+    formula->width = render.getWidth();
+    formula->height = render.getHeight();
+    formula->depth = render.getDepth();
+    formula->mask = image.convertToFormat(QImage::Format_Alpha8);
+    formula->mask.setDevicePixelRatio(device_pixel_ratio);
+
+    record_header record{};
+    record.source_bytes = source.size();
+    record.width = formula->width;
+    record.height = formula->height;
+    record.depth = formula->depth;
+    record.text_size = static_cast<uint16_t>(text_size);
+    record.is_inline = isInline ? 1 : 0;
+    record.device_pixel_ratio = static_cast<float>(device_pixel_ratio);
+    record.mask_width = formula->mask.width();
+    record.mask_height = formula->mask.height();
+    record.mask_bytes_per_line = formula->mask.bytesPerLine();
+    qint64 mask_bytes = qint64(record.mask_bytes_per_line) * record.mask_height;
+    record.record_bytes = sizeof(record_header) + padded(record.source_bytes) + padded(mask_bytes);
+
+    QByteArray bytes;
+    bytes.reserve(record.record_bytes);
+    bytes.append(reinterpret_cast<const char*>(&record), sizeof(record));
+    bytes.append(source);
+    bytes.append(QByteArray(padded(source.size()) - source.size(), '\0'));
+    bytes.append(reinterpret_cast<const char*>(formula->mask.constBits()), mask_bytes);
+    bytes.append(QByteArray(padded(mask_bytes) - mask_bytes, '\0'));
+
+    QMutexLocker lock(&m_mutex);
+    if(!m_file) return;
+    record.key_hash = keyHash(source, isInline, text_size, device_pixel_ratio);
+    std::memcpy(bytes.data(), &record, sizeof(record));
+    if(m_loaded.contains(record.key_hash)) return;
+    if(!m_file->file.seek(m_file_bytes) || m_file->file.write(bytes) != bytes.size()){
+        //leave the tail for the next open to cut
+        return;
+    }
+    m_file_bytes += bytes.size();
+    m_appended++;
+    m_writes++;
+    m_loaded.insert(record.key_hash, loaded_formula{source, isInline, text_size, ratio_key(device_pixel_ratio), formula});
+}
+
+bool FormulaDiskCache::flush(){
+    QMutexLocker lock(&m_mutex);
+    return m_file && m_file->file.flush();
+}
+
+void FormulaDiskCache::setMaxFileBytes(size_t bytes){
+    QMutexLocker lock(&m_mutex);
+    m_max_file_bytes = bytes;
+}
+
+size_t FormulaDiskCache::maxFileBytes() const{
+    QMutexLocker lock(&m_mutex);
+    return m_max_file_bytes;
+}
+
+formula_disk_cache_stats FormulaDiskCache::stats() const{
+    QMutexLocker lock(&m_mutex);
+    formula_disk_cache_stats result;
+    result.hits = m_hits;
+    result.misses = m_misses;
+    result.writes = m_writes;
+    result.entries = m_index.size() + m_appended;
+    result.file_bytes = m_file_bytes;
+    return result;
+}
+
+void FormulaDiskCache::resetStats(){
+    QMutexLocker lock(&m_mutex);
+    m_hits = 0;
+    m_misses = 0;
+    m_writes = 0;
+}
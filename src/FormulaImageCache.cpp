@@ -0,0 +1,145 @@
+#include "FormulaImageCache.h"
+#include "FormulaDiskCache.h"
+#include "LatexCache.h"
+#include "platform/qt/graphic_qt.h"
+#include <QPainter>
+#include <cmath>
+
+size_t qHash(const formula_image_key& key, size_t seed){
+    return qHashMulti(seed, reinterpret_cast<quintptr>(key.source), key.device_pixel_ratio, key.color);
+}
+
+FormulaImageCache& FormulaImageCache::instance(){
+    static FormulaImageCache cache;
+    return cache;
+}
+
+QImage FormulaImageCache::rasterize(tex::TeXRender& render, qreal device_pixel_ratio, QRgb color){
+    QSize size(render.getWidth() + 2*padding, render.getHeight() + 2*padding);
+    QImage image(QSize(std::ceil(size.width() * device_pixel_ratio), std::ceil(size.height() * device_pixel_ratio)), QImage::Format_ARGB32_Premultiplied);
+    image.setDevicePixelRatio(device_pixel_ratio);
+    image.fill(Qt::transparent);
+
+    QPainter painter(&image);
+    painter.setRenderHint(QPainter::Antialiasing, true);
+    painter.setBrush(QColor::fromRgba(color));
+    QMutexLocker lock(&microtexMutex());
+    tex::Graphics2D_qt g2(&painter);
+    render.draw(g2, padding, padding);
+    return image;
+}
+
+QImage FormulaImageCache::tint(const stored_formula& formula, QRgb color){
+    QImage image(formula.mask.size(), QImage::Format_ARGB32_Premultiplied);
+    image.setDevicePixelRatio(formula.mask.devicePixelRatio());
+    image.fill(QColor::fromRgba(color));
+    QPainter painter(&image);
+    painter.setCompositionMode(QPainter::CompositionMode_DestinationIn);
+    painter.drawImage(QPoint(0, 0), formula.mask);
+    return image;
+}
+
+template<typename Source, typename Paint>
+QImage FormulaImageCache::cached(const std::shared_ptr<Source>& source, qreal device_pixel_ratio, QRgb color, Paint paint){
+    formula_image_key key{source.get(), device_pixel_ratio, color};
+    {
+        QMutexLocker lock(&m_mutex);
+        auto it = m_entries.find(key);
+        if(it != m_entries.end()){
+            if(it.value()->source.lock() == source){
+                m_hits++;
+                m_lru.splice(m_lru.begin(), m_lru, it.value());
+                return it.value()->image;
+            }
+            //the address belongs to something newer
+            m_bytes -= it.value()->bytes;
+            m_lru.erase(it.value());
+            m_entries.erase(it);
+        }
+        m_misses++;
+    }
+
+    //rasterize without holding the lock, other threads can blit meanwhile
+    QImage image = paint();
+
+    QMutexLocker lock(&m_mutex);
+    auto it = m_entries.find(key);
+    if(it != m_entries.end()){
+        return it.value()->image; //rasterized by another thread in the meantime
+    }
+    size_t bytes = static_cast<size_t>(image.sizeInBytes());
+    m_lru.push_front(cache_entry{key, source, image, bytes});
+    m_entries.insert(key, m_lru.begin());
+    m_bytes += bytes;
+    evict();
+    return image;
+}
+
+QImage FormulaImageCache::image(const std::shared_ptr<tex::TeXRender>& render, qreal device_pixel_ratio, QRgb color){
+    return cached(render, device_pixel_ratio, color, [&]() { return rasterize(*render, device_pixel_ratio, color); });
+}
+
+QImage FormulaImageCache::image(const std::shared_ptr<const stored_formula>& formula, QRgb color){
+    return cached(formula, formula->mask.devicePixelRatio(), color, [&]() { return tint(*formula, color); });
+}
+
+void FormulaImageCache::purge(){
+    QMutexLocker lock(&m_mutex);
+    for(auto it = m_lru.begin(); it != m_lru.end();){
+        if(it->source.expired()){
+            m_bytes -= it->bytes;
+            m_entries.remove(it->key);
+            it = m_lru.erase(it);
+        }
+        else{
+            ++it;
+        }
+    }
+}
+
+void FormulaImageCache::evict(){
+    while(m_bytes > m_byte_budget && !m_lru.empty()){
+        cache_entry& victim = m_lru.back();
+        m_bytes -= victim.bytes;
+        m_entries.remove(victim.key);
+        m_lru.pop_back();
+        m_evictions++;
+    }
+}
+
+void FormulaImageCache::setByteBudget(size_t bytes){
+    QMutexLocker lock(&m_mutex);
+    m_byte_budget = bytes;
+    evict();
+}
+
+size_t FormulaImageCache::byteBudget() const{
+    QMutexLocker lock(&m_mutex);
+    return m_byte_budget;
+}
+
+formula_image_stats FormulaImageCache::stats() const{
+    QMutexLocker lock(&m_mutex);
+    formula_image_stats result;
+    result.hits = m_hits;
+    result.misses = m_misses;
+    result.evictions = m_evictions;
+    result.entries = m_lru.size();
+    result.bytes = m_bytes;
+    result.byte_budget = m_byte_budget;
+    return result;
+}
+
+void FormulaImageCache::resetStats(){
+    QMutexLocker lock(&m_mutex);
+    m_hits = 0;
+    m_misses = 0;
+    m_evictions = 0;
+}
+
+void FormulaImageCache::clear(){
+    QMutexLocker lock(&m_mutex);
+    m_entries.clear();
+    m_lru.clear();
+    m_bytes = 0;
+}
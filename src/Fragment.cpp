@@ -0,0 +1,181 @@
+#include "Fragment.h"
+#include <algorithm>
+
+static QString type_name(fragment_type type){
+    switch(type) {
+        case fragment_type::text: return "text";
+        case fragment_type::latex: return "latex";
+        case fragment_type::line: return "line";
+        case fragment_type::rounded_rect: return "rounded_rect";
+        case fragment_type::code_lines: return "code_lines";
+        case fragment_type::button: return "button";
+    }
+    return "unknown";
+}
+
+static QString describe_fragment(const Fragment& fragment){
+    QString result = QString("type: ") + type_name(fragment.type);
+    result += QString(", bounding_box: (%1,%2,%3,%4)")
+                .arg(fragment.bounding_box.x())
+                .arg(fragment.bounding_box.y())
+                .arg(fragment.bounding_box.width())
+                .arg(fragment.bounding_box.height());
+    result += QString(", highlighted: %1").arg(fragment.is_highlighted ? "true" : "false");
+    return result;
+}
+
+static QString shorten(QString text){
+    if(text.length() > 50) {
+        text = text.left(47) + "...";
+    }
+    return text.replace('\n', "\\n").replace('\t', "\\t");
+}
+
+QDebug operator<<(QDebug debug, const Fragment& fragment){
+    debug.noquote() << "Fragment{" + describe_fragment(fragment) + "}";
+    return debug;
+}
+
+std::ostream& operator<<(std::ostream& os, const Fragment& fragment){
+    os << ("Fragment{" + describe_fragment(fragment) + "}").toStdString();
+    return os;
+}
+
+qsizetype DisplayList::appendChars(QStringView text){
+    qsizetype offset = m_chars.size();
+    m_chars.append(text);
+    return offset;
+}
+
+void DisplayList::addText(QRect bounding_box, QStringView text, font_type style, QPalette::ColorRole color){
+    m_fragments.push_back(Fragment{bounding_box, fragment_type::text, false, static_cast<uint32_t>(m_texts.size())});
+    m_texts.push_back(frag_text_data{appendChars(text), text.size(), static_cast<uint8_t>(style), color, std::nullopt});
+}
+
+void DisplayList::addLatex(QRect bounding_box, std::shared_ptr<tex::TeXRender> render, const QString& text, bool isInline, std::shared_ptr<const stored_formula> stored){
+    m_fragments.push_back(Fragment{bounding_box, fragment_type::latex, false, static_cast<uint32_t>(m_latex.size())});
+    m_latex.push_back(frag_latex_data{std::move(render), text, isInline, std::move(stored)});
+}
+
+void DisplayList::addLine(QRect bounding_box, QPoint to, int width){
+    m_fragments.push_back(Fragment{bounding_box, fragment_type::line, false, static_cast<uint32_t>(m_lines.size())});
+    m_lines.push_back(frag_line_data{to, width});
+}
+
+void DisplayList::addRoundedRect(QRect bounding_box, const frag_rrect_data& data){
+    m_fragments.push_back(Fragment{bounding_box, fragment_type::rounded_rect, false, static_cast<uint32_t>(m_rrects.size())});
+    m_rrects.push_back(data);
+}
+
+void DisplayList::addCodeLines(QRect clip_area, int text_x, int codeBlock_id){
+    m_fragments.push_back(Fragment{clip_area, fragment_type::code_lines, false, static_cast<uint32_t>(m_code.size())});
+    m_code.push_back(frag_code_data{text_x, static_cast<uint32_t>(codeBlock_id)});
+}
+
+void DisplayList::addButton(QRect bounding_box, int codeBlock_id){
+    m_fragments.push_back(Fragment{bounding_box, fragment_type::button, false, static_cast<uint32_t>(m_buttons.size())});
+    m_buttons.push_back(frag_button_data{static_cast<uint32_t>(codeBlock_id)});
+}
+
+void DisplayList::truncate(size_t from){
+    if(from >= m_fragments.size()) return;
+    //tables are filled in fragment order, the first dropped entry of each type marks where it gets cut
+    size_t texts = m_texts.size(), lines = m_lines.size(), rrects = m_rrects.size(), latex = m_latex.size(), code = m_code.size(), buttons = m_buttons.size();
+    qsizetype chars = m_chars.size();
+    bool found_text = false, found_line = false, found_rrect = false, found_latex = false, found_code = false, found_button = false;
+    for(size_t i = from; i < m_fragments.size(); i++) {
+        const Fragment& f = m_fragments[i];
+        switch(f.type) {
+            case fragment_type::text:
+                if(!found_text) {
+                    found_text = true;
+                    texts = f.data;
+                    chars = std::min(chars, m_texts[f.data].offset);
+                }
+                break;
+            case fragment_type::code_lines:
+                if(!found_code) { found_code = true; code = f.data; }
+                break;
+            case fragment_type::line:
+                if(!found_line) { found_line = true; lines = f.data; }
+                break;
+            case fragment_type::rounded_rect:
+                if(!found_rrect) { found_rrect = true; rrects = f.data; }
+                break;
+            case fragment_type::latex:
+                if(!found_latex) { found_latex = true; latex = f.data; }
+                break;
+            case fragment_type::button:
+                if(!found_button) { found_button = true; buttons = f.data; }
+                break;
+        }
+    }
+    m_fragments.erase(m_fragments.begin() + from, m_fragments.end());
+    m_texts.erase(m_texts.begin() + texts, m_texts.end());
+    m_lines.erase(m_lines.begin() + lines, m_lines.end());
+    m_rrects.erase(m_rrects.begin() + rrects, m_rrects.end());
+    m_latex.erase(m_latex.begin() + latex, m_latex.end()); // drops the references to the renders, the AST and the cache keep theirs
+    m_code.erase(m_code.begin() + code, m_code.end());
+    m_buttons.erase(m_buttons.begin() + buttons, m_buttons.end());
+    m_chars.truncate(chars);
+}
+
+QString DisplayList::describe(size_t i) const{
+    const Fragment& fragment = m_fragments[i];
+    QString result = "Fragment{" + describe_fragment(fragment);
+
+    //Add type-specific data
+    switch(fragment.type) {
+        case fragment_type::text: {
+            const frag_text_data& data = text(fragment);
+            result += QString(", text: \"%1\"").arg(shorten(chars(data).toString()));
+            result += QString(", style: %1").arg(data.style);
+            result += QString(", color: %1").arg(data.color);
+            break;
+        }
+        case fragment_type::latex: {
+            const frag_latex_data& data = latex(fragment);
+            result += QString(", latex: \"%1\"").arg(shorten(data.text));
+            result += QString(", inline: %1").arg(data.isInline ? "true" : "false");
+            if(data.render) {
+                result += QString(", render_size: %1x%2")
+                            .arg(data.render->getWidth())
+                            .arg(data.render->getHeight());
+            }
+            break;
+        }
+        case fragment_type::line: {
+            const frag_line_data& data = line(fragment);
+            result += QString(", to: (%1,%2)").arg(data.to.x()).arg(data.to.y());
+            result += QString(", width: %1").arg(data.width);
+            break;
+        }
+        case fragment_type::rounded_rect: {
+            const frag_rrect_data& data = roundedRect(fragment);
+            result += QString(", rect: (%1,%2,%3,%4)")
+                        .arg(data.rect.x())
+                        .arg(data.rect.y())
+                        .arg(data.rect.width())
+                        .arg(data.rect.height());
+            result += QString(", radii: (tl:%1,tr:%2,bl:%3,br:%4)")
+                        .arg(data.topLeftRadius)
+                        .arg(data.topRightRadius)
+                        .arg(data.bottomLeftRadius)
+                        .arg(data.bottomRightRadius);
+            result += QString(", bg: %1, stroke: %2").arg(data.background).arg(data.stroke);
+            break;
+        }
+        case fragment_type::code_lines: {
+            const frag_code_data& data = codeLines(fragment);
+            result += QString(", code_block: %1, text_x: %2").arg(data.codeBlock_id).arg(data.text_x);
+            break;
+        }
+        case fragment_type::button: {
+            result += QString(", code_block: %1").arg(button(fragment).codeBlock_id);
+            break;
+        }
+    }
+
+    result += "}";
+    return result;
+}
@@ -0,0 +1,69 @@
+#include "FragmentIndex.h"
+#include <algorithm>
+
+int FragmentIndex::bandOf(int y){
+    return y < 0 ? 0 : y / band_height;
+}
+
+void FragmentIndex::insert(size_t fragment, const QRect& bounding_box){
+    int first = bandOf(bounding_box.top());
+    int last = bandOf(bounding_box.bottom());
+    if(last >= (int)m_bands.size()){
+        m_bands.resize(last + 1);
+    }
+    for(int band = first; band <= last; band++){
+        m_bands[band].push_back(static_cast<uint32_t>(fragment));
+    }
+    if(fragment >= m_first_band.size()){
+        m_first_band.resize(fragment + 1, 0);
+    }
+    m_first_band[fragment] = static_cast<uint32_t>(first);
+    m_fragments = std::max(m_fragments, fragment + 1);
+}
+
+void FragmentIndex::truncate(size_t from){
+    if(from >= m_fragments) return;
+    //streaming truncates near the end, only the bands of the dropped fragments are visited
+    size_t first = m_bands.size();
+    for(size_t fragment = from; fragment < m_first_band.size(); fragment++){
+        first = std::min<size_t>(first, m_first_band[fragment]);
+    }
+    for(size_t band = first; band < m_bands.size(); band++){
+        while(!m_bands[band].empty() && m_bands[band].back() >= from){
+            m_bands[band].pop_back();
+        }
+    }
+    m_first_band.resize(std::min(m_first_band.size(), from));
+    while(!m_bands.empty() && m_bands.back().empty()){
+        m_bands.pop_back();
+    }
+    m_fragments = from;
+}
+
+void FragmentIndex::clear(){
+    m_bands.clear();
+    m_first_band.clear();
+    m_fragments = 0;
+}
+
+void FragmentIndex::query(int top, int bottom, std::vector<uint32_t>& out) const{
+    out.clear();
+    if(m_bands.empty() || bottom < top) return;
+    int first = bandOf(top);
+    int last = std::min(bandOf(bottom), (int)m_bands.size() - 1);
+    for(int band = first; band <= last; band++){
+        out.insert(out.end(), m_bands[band].begin(), m_bands[band].end());
+    }
+    if(first != last){
+        //fragments spanning several bands show up once per band
+        std::sort(out.begin(), out.end());
+        out.erase(std::unique(out.begin(), out.end()), out.end());
+    }
+}
+
+const std::vector<uint32_t>& FragmentIndex::band(int y) const{
+    static const std::vector<uint32_t> empty;
+    int b = bandOf(y);
+    if(y < 0 || b >= (int)m_bands.size()) return empty;
+    return m_bands[b];
+}
@@ -0,0 +1,196 @@
+#include "LatexCache.h"
+#include "latex.h"
+#include "core/formula.h"
+#include <exception>
+#include <QMetaObject>
+
+size_t qHash(const latex_cache_key& key, size_t seed){
+    return qHashMulti(seed, key.latex, key.isInline, key.text_size, key.color);
+}
+
+QMutex& microtexMutex(){
+    static QMutex mutex;
+    return mutex;
+}
+
+static tex::TeXRender* build_render(const QString& latex, bool isInline, int text_size, QRgb argb_color){
+    QMutexLocker lock(&microtexMutex());
+    try {
+        tex::Formula formula;
+        formula.setLaTeX(latex.toStdWString());
+        float width = 600;
+        tex::Alignment alignment= isInline ? tex::Alignment::left : tex::Alignment::center;
+        float linespace = isInline ? text_size : text_size + 2;
+        tex::TexStyle style = isInline ? tex::TexStyle::text : tex::TexStyle::display;
+
+        tex::TeXRenderBuilder builder;
+        tex::TeXRender* render = builder
+            .setStyle(style)
+            .setTextSize(text_size)
+            .setWidth(tex::UnitType::pixel, width, alignment)
+            .setIsMaxWidth(true)
+            .setLineSpace(tex::UnitType::point, linespace)
+            .setForeground(argb_color)
+            .build(formula._root);
+
+        return render;
+    } catch (const std::exception& e) {
+        return nullptr;
+    }
+}
+
+// MicroTeX doesn't expose the size of a box tree, it grows roughly with the
+// length of the source, so that is what the budget is measured in.
+static size_t estimate_bytes(const latex_cache_key& key){
+    return sizeof(tex::TeXRender) + 512 + static_cast<size_t>(key.latex.size()) * 256;
+}
+
+LatexRenderCache::LatexRenderCache(){
+    m_pool.setMaxThreadCount(1); //builds are serialized anyway
+}
+
+LatexRenderCache& LatexRenderCache::instance(){
+    static LatexRenderCache cache;
+    return cache;
+}
+
+std::shared_ptr<tex::TeXRender> LatexRenderCache::get(const QString& latex, bool isInline, int text_size, QRgb argb_color){
+    latex_cache_key key{latex, isInline, text_size, argb_color};
+    {
+        QMutexLocker lock(&m_mutex);
+        auto it = m_entries.find(key);
+        if(it != m_entries.end()){
+            m_hits++;
+            m_lru.splice(m_lru.begin(), m_lru, it.value());
+            return it.value()->render;
+        }
+        m_misses++;
+    }
+
+    //build without holding the lock, formulas can take a while
+    std::shared_ptr<tex::TeXRender> render(build_render(latex, isInline, text_size, argb_color));
+
+    QMutexLocker lock(&m_mutex);
+    return insert(key, render);
+}
+
+std::shared_ptr<tex::TeXRender> LatexRenderCache::insert(const latex_cache_key& key, std::shared_ptr<tex::TeXRender> render){
+    auto it = m_entries.find(key);
+    if(it != m_entries.end()){
+        //someone else built it in the meantime, keep theirs so the render is shared
+        m_lru.splice(m_lru.begin(), m_lru, it.value());
+        return it.value()->render;
+    }
+    size_t bytes = estimate_bytes(key);
+    m_lru.push_front(cache_entry{key, render, bytes});
+    m_entries.insert(key, m_lru.begin());
+    m_bytes += bytes;
+    evict();
+    return render;
+}
+
+std::shared_ptr<tex::TeXRender> LatexRenderCache::lookup(const QString& latex, bool isInline, int text_size, QRgb argb_color, bool* found){
+    latex_cache_key key{latex, isInline, text_size, argb_color};
+    QMutexLocker lock(&m_mutex);
+    auto it = m_entries.find(key);
+    if(it == m_entries.end()){
+        m_misses++;
+        *found = false;
+        return nullptr;
+    }
+    m_hits++;
+    m_lru.splice(m_lru.begin(), m_lru, it.value());
+    *found = true;
+    return it.value()->render;
+}
+
+void LatexRenderCache::requestAsync(const QString& latex, bool isInline, int text_size, QRgb argb_color, QObject* receiver, std::function<void(std::shared_ptr<tex::TeXRender>)> on_ready){
+    latex_cache_key key{latex, isInline, text_size, argb_color};
+    QMutexLocker lock(&m_mutex);
+    auto it = m_entries.find(key);
+    if(it != m_entries.end()){
+        //finished between the caller's lookup and now
+        QMetaObject::invokeMethod(receiver, [on_ready = std::move(on_ready), render = it.value()->render]() { on_ready(render); }, Qt::QueuedConnection);
+        return;
+    }
+    auto pending = m_pending.find(key);
+    if(pending != m_pending.end()){
+        //already queued, just make sure this receiver hears about it
+        for(const pending_request& request : pending.value()){
+            if(request.receiver == receiver) return;
+        }
+        pending.value().push_back(pending_request{receiver, std::move(on_ready)});
+        return;
+    }
+    m_pending[key].push_back(pending_request{receiver, std::move(on_ready)});
+
+    m_pool.start([this, key]() {
+        std::shared_ptr<tex::TeXRender> render(build_render(key.latex, key.isInline, key.text_size, key.color));
+
+        QMutexLocker lock(&m_mutex);
+        render = insert(key, render);
+        //posting under the lock, cancelRequests can't run between the check and the post
+        for(pending_request& request : m_pending.take(key)){
+            QMetaObject::invokeMethod(request.receiver, [on_ready = std::move(request.on_ready), render]() { on_ready(render); }, Qt::QueuedConnection);
+        }
+    });
+}
+
+void LatexRenderCache::cancelRequests(QObject* receiver){
+    QMutexLocker lock(&m_mutex);
+    for(auto it = m_pending.begin(); it != m_pending.end(); ++it){
+        std::vector<pending_request>& requests = it.value();
+        std::erase_if(requests, [receiver](const pending_request& request) { return request.receiver == receiver; });
+    }
+}
+
+void LatexRenderCache::waitForAsyncBuilds(){
+    m_pool.waitForDone();
+}
+
+void LatexRenderCache::evict(){
+    while(m_bytes > m_byte_budget && !m_lru.empty()){
+        cache_entry& victim = m_lru.back();
+        m_bytes -= victim.bytes;
+        m_entries.remove(victim.key);
+        m_lru.pop_back();
+        m_evictions++;
+    }
+}
+
+void LatexRenderCache::setByteBudget(size_t bytes){
+    QMutexLocker lock(&m_mutex);
+    m_byte_budget = bytes;
+    evict();
+}
+
+size_t LatexRenderCache::byteBudget() const{
+    QMutexLocker lock(&m_mutex);
+    return m_byte_budget;
+}
+
+latex_cache_stats LatexRenderCache::stats() const{
+    QMutexLocker lock(&m_mutex);
+    latex_cache_stats result;
+    result.hits = m_hits;
+    result.misses = m_misses;
+    result.evictions = m_evictions;
+    result.entries = m_lru.size();
+    result.bytes = m_bytes;
+    result.byte_budget = m_byte_budget;
+    return result;
+}
+
+void LatexRenderCache::resetStats(){
+    QMutexLocker lock(&m_mutex);
+    m_hits = 0;
+    m_misses = 0;
+    m_evictions = 0;
+}
+
+void LatexRenderCache::clear(){
+    QMutexLocker lock(&m_mutex);
+    m_entries.clear();
+    m_lru.clear();
+    m_bytes = 0;
+}
@@ -1,5 +1,10 @@
 #include "LatexLabel.h"
 #include "Fragment.h"
+#include "MarkdownScanner.h"
+#include "LatexCache.h"
+#include "FormulaImageCache.h"
+#include "FormulaDiskCache.h"
+#include "StyleTable.h"
 #include "platform/qt/graphic_qt.h"
 #include "utils/enums.h"
 #include <QRegularExpression>
@@ -9,40 +14,61 @@
 #include <algorithm>
 #include <cstddef>
 #include <cstdint>
+#include <climits>
 #include <cstdlib>
 #include <QPaintEvent>
 #include <QMouseEvent>
 #include <QResizeEvent>
+#include <QMoveEvent>
+#include <QScrollBar>
+#include <cmath>
 #include <QEvent>
 #include <QTextOption>
 #include <QFrame>
 #include <QStyleOption>
 #include <QStyle>
 #include <QPainterPath>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QThread>
+#include <QSemaphore>
 #include <md4c.h>
 #include <variant>
 #include <vector>
 #include "latex.h"
-#include "core/formula.h"
 
 static double widget_height=200;
+static std::atomic<uint64_t> next_style_generation{1};
+
+// Fonts are not shared across threads. A tile worker keeps its own table
+// between paints and only builds it again once the label's styles changed.
+static StyleTable& worker_styles(uint64_t generation, int text_size, const QString& family, const QString& code_family){
+    thread_local uint64_t built_generation = 0;
+    thread_local std::unique_ptr<StyleTable> styles;
+    if(!styles || built_generation != generation){
+        styles = std::make_unique<StyleTable>(text_size, family, code_family);
+        built_generation = generation;
+    }
+    return *styles;
+}
+static constexpr qsizetype parallel_parse_piece=128*1024; // smallest piece worth a thread of its own, in characters
 
-LatexLabel::LatexLabel(QWidget* parent) : QWidget(parent), _render(nullptr), m_textSize(12) {
+LatexLabel::LatexLabel(QWidget* parent) : QWidget(parent), _render(nullptr), m_textSize(12), m_styles(m_textSize, m_font_family, m_code_font_family) {
 
     setSizePolicy(QSizePolicy::Preferred, QSizePolicy::Expanding);
     setFocusPolicy(Qt::StrongFocus);
-    QFontMetricsF base_metric(QFont("Arial",m_textSize));
+    m_style_generation = next_style_generation++;
     setAttribute(Qt::WA_StyledBackground, true);
+    setMouseTracking(true); //hover of the Copy buttons
     widget_height=300; // Start with a reasonable height
     setMinimumHeight(widget_height);
+    m_parse_pool.setMaxThreadCount(1); //a newer parse only starts once the older one gave up
 }
 
 LatexLabel::~LatexLabel(){
-    //Clean up all segments and their children
-    cleanup_segments(m_segments);
-    for(auto& info: m_code_block_info){
-        info.button->deleteLater();
-    }
+    m_parse_generation++;
+    m_parse_pool.waitForDone();
+    LatexRenderCache::instance().cancelRequests(this);
 }
 QSize LatexLabel::sizeHint() const{
     //Return a flexible size hint that works well with scroll areas
@@ -52,60 +78,176 @@ QSize LatexLabel::sizeHint() const{
 void LatexLabel::setTextSize(int size) {
     if(size != m_textSize && size > 0) {
         m_textSize = size;
-        parseMarkdown(m_text); //parse again to set size for latex expressions
+        rebuildStyles();
+        //latex expressions are built for a size, the markdown structure stays the same
+        QRgb argb_color = palette().text().color().rgba();
+        refreshLatexRenders(argb_color);
+        FormulaImageCache::instance().purge(); //images of renders no label uses anymore
+        relayout(width());
         update();    // Trigger repaint
     }
 }
 
+void LatexLabel::rebuildStyles() {
+    m_styles.rebuild(m_textSize, m_font_family, m_code_font_family);
+    m_style_generation = next_style_generation++;
+    for(layoutInfoCodeBlock& info : m_code_block_info) {
+        info.measured = false;
+    }
+}
+
 int LatexLabel::getTextSize() const {
     return m_textSize;
 }
 
-tex::TeXRender* getLatexRenderer(const QString& latex, bool isInline, int text_size, QRgb argb_color) {
-    try {
-        tex::Formula formula;
-        formula.setLaTeX(latex.toStdWString());
-        float width = 600;
-        tex::Alignment alignment= isInline ? tex::Alignment::left : tex::Alignment::center;
-        float linespace = isInline ? text_size : text_size + 2;
-        tex::TexStyle style = isInline ? tex::TexStyle::text : tex::TexStyle::display;
+void LatexLabel::setAsyncLatex(bool enabled) {
+    if(enabled == m_async_latex) return;
+    m_async_latex = enabled;
+    if(!enabled && !m_segments.empty()) {
+        //build whatever is still pending right here
+        QRgb argb_color = palette().text().color().rgba();
+        refreshLatexRenders(argb_color);
+        relayout(width());
+        update();
+    }
+}
 
-        tex::TeXRenderBuilder builder;
-        tex::TeXRender* render = builder
-            .setStyle(style)
-            .setTextSize(text_size)
-            .setWidth(tex::UnitType::pixel, width, alignment)
-            .setIsMaxWidth(true)
-            .setLineSpace(tex::UnitType::point, linespace)
-            .setForeground(argb_color)
-            .build(formula._root);
+bool LatexLabel::asyncLatex() const {
+    return m_async_latex;
+}
 
-        return render;
-    } catch (const std::exception& e) {
-        return nullptr;
-    }
+void LatexLabel::setFontFamily(const QString& family) {
+    if(family == m_font_family) return;
+    m_font_family = family;
+    rebuildStyles();
+    relayout(width());
+    update();
+}
+
+QString LatexLabel::fontFamily() const {
+    return m_font_family;
+}
+
+void LatexLabel::setCodeFontFamily(const QString& family) {
+    if(family == m_code_font_family) return;
+    m_code_font_family = family;
+    rebuildStyles();
+    relayout(width());
+    update();
+}
+
+QString LatexLabel::codeFontFamily() const {
+    return m_code_font_family;
+}
+
+word_advance_stats LatexLabel::wordAdvanceStats() const {
+    return m_styles.advanceCache().stats();
+}
+
+void LatexLabel::resetWordAdvanceStats() {
+    m_styles.advanceCache().resetStats();
+}
+
+void LatexLabel::setWordAdvanceCacheCapacity(size_t entries) {
+    m_styles.advanceCache().setCapacity(entries);
+}
+
+void LatexLabel::setVirtualized(bool enabled) {
+    if(enabled == m_virtualized) return;
+    m_virtualized = enabled;
+    m_realized_first = 0;
+    m_realized_last = 0;
+    relayout(width());
+    update();
+}
+
+bool LatexLabel::virtualized() const {
+    return m_virtualized;
+}
+
+void LatexLabel::setBackgroundParsing(bool enabled) {
+    m_background_parsing = enabled;
+}
+
+bool LatexLabel::backgroundParsing() const {
+    return m_background_parsing;
+}
+
+void LatexLabel::setBackgroundParseThreshold(qsizetype bytes) {
+    m_background_parse_threshold = bytes;
+}
+
+bool LatexLabel::parsePending() const {
+    return m_parse_pending;
+}
+
+void LatexLabel::waitForParsing() {
+    m_parse_pool.waitForDone();
+    //the swap was posted by the worker, run it now
+    QCoreApplication::sendPostedEvents(this, QEvent::MetaCall);
+}
+
+phase_timings LatexLabel::timings() const {
+    return m_timings;
+}
+
+void LatexLabel::resetTimings() {
+    m_timings = phase_timings();
+}
+
+size_t LatexLabel::fragmentCount() const {
+    return m_display_list.size();
+}
+
+void LatexLabel::setTileCaching(bool enabled) {
+    if(enabled == m_tile_caching) return;
+    m_tile_caching = enabled;
+    m_tiles.clear();
+    update();
+}
+
+bool LatexLabel::tileCaching() const {
+    return m_tile_caching;
+}
+
+tile_cache_stats LatexLabel::tileCacheStats() const {
+    return m_tiles.stats();
+}
+
+void LatexLabel::setTileThreads(int threads) {
+    m_tile_threads = std::max(0, threads);
+}
+
+int LatexLabel::tileThreads() const {
+    return m_tile_threads;
+}
+
+std::shared_ptr<tex::TeXRender> getLatexRenderer(const QString& latex, bool isInline, int text_size, QRgb argb_color) {
+    return LatexRenderCache::instance().get(latex, isInline, text_size, argb_color);
 }
 
 
 // md4c callback functions
+// md4c points into the source for most text. Code block newlines and
+// indentation are literals of its own, attributes with escapes are decoded
+// into a buffer that is gone after the callback.
+static source_text in_source(const MarkdownParserState& state, const MD_CHAR* text, MD_SIZE size) {
+    source_text result;
+    if(text >= state.source && text + size <= state.source + state.source_size) {
+        result.range = source_range{text - state.source, static_cast<qsizetype>(size)};
+    }
+    else {
+        result.literal = QString::fromUtf8(text, size);
+    }
+    return result;
+}
+
 int LatexLabel::enterBlockCallback(MD_BLOCKTYPE type, void* detail, void* userdata) {
-    struct ExtendedParserState {
-        MarkdownParserState* state;
-        LatexLabel* label;
-    };
-    ExtendedParserState* extState = static_cast<ExtendedParserState*>(userdata);
-    MarkdownParserState* state = extState->state;
-    Element* block = new Element(DisplayType::block, {}, spantype::normal, type);
+    MarkdownParserState* state = static_cast<MarkdownParserState*>(userdata);
+    if(state->cancelled()) return 1; //a newer setText, md4c stops right here
+    ElementTree* tree = state->tree;
+    Element block(DisplayType::block, {}, spantype::normal, type);
     switch(type) {
-        case MD_BLOCK_DOC:{
-            state->blockStack.push_back(block);
-            break;
-        }
-        case MD_BLOCK_QUOTE:{
-            state->blockStack.back()->children.push_back(block);
-            state->blockStack.push_back(block);
-            break;
-        }
         case MD_BLOCK_UL:{
             list_data data;
             data.is_ordered = false;
@@ -114,9 +256,7 @@ int LatexLabel::enterBlockCallback(MD_BLOCKTYPE type, void* detail, void* userda
 
                 data.mark=ul_detail->mark;
             }
-            block->data=data;
-            state->blockStack.back()->children.push_back(block);
-            state->blockStack.push_back(block);
+            block.data=data;
             break;
         }
         case MD_BLOCK_OL:{
@@ -127,27 +267,18 @@ int LatexLabel::enterBlockCallback(MD_BLOCKTYPE type, void* detail, void* userda
                 data.start_index = (uint16_t) ol_detail->start;
                 data.mark= ol_detail->mark_delimiter;
             }
-            block->data=data;
-            state->blockStack.back()->children.push_back(block);
-            state->blockStack.push_back(block);
+            block.data=data;
             break;
         }
         case MD_BLOCK_LI:{
             list_item_data data;
-            Element* parent = state->blockStack.back();
-            data.is_ordered = std::get<list_data>(parent->data).is_ordered;
-            data.item_index = parent->children.size()+1;
-            block->data=data;
-            state->blockStack.back()->children.push_back(block);
-            state->blockStack.push_back(block);
+            const Element& parent = tree->openBlockElement();
+            data.is_ordered = std::get<list_data>(parent.data).is_ordered;
+            data.item_index = tree->openChildCount()+1;
+            block.data=data;
 
             break;
         }
-        case MD_BLOCK_HR:{
-            state->blockStack.back()->children.push_back(block);
-            state->blockStack.push_back(block);
-            break;
-        }
         case MD_BLOCK_H:{
             heading_data data;
             if(detail) {
@@ -157,9 +288,7 @@ int LatexLabel::enterBlockCallback(MD_BLOCKTYPE type, void* detail, void* userda
             else{
                 data.level = 1;
             }
-            block->data=data;
-            state->blockStack.back()->children.push_back(block);
-            state->blockStack.push_back(block);
+            block.data=data;
             break;
         }
         case MD_BLOCK_CODE:{
@@ -167,91 +296,53 @@ int LatexLabel::enterBlockCallback(MD_BLOCKTYPE type, void* detail, void* userda
             if(detail) {
                 MD_BLOCK_CODE_DETAIL* code_detail = (MD_BLOCK_CODE_DETAIL*)(detail);
                 if(code_detail->lang.text) {
-                    data.language = QString::fromUtf8(code_detail->lang.text, code_detail->lang.size);
+                    data.language = in_source(*state, code_detail->lang.text, code_detail->lang.size);
                 }
             }
-            block->data=data;
-            state->blockStack.back()->children.push_back(block);
-            state->blockStack.push_back(block);
+            block.data=data;
             break;
         }
         case MD_BLOCK_HTML:{
             qDebug()<<"html block not supported";
-            break;
-        }
-        case MD_BLOCK_P:{
-            state->blockStack.back()->children.push_back(block);
-            state->blockStack.push_back(block);
-            break;
-        }
-        case MD_BLOCK_TABLE:{
-            state->blockStack.back()->children.push_back(block);
-            state->blockStack.push_back(block);
-            break;
-        }
-        case MD_BLOCK_THEAD:{
-            state->blockStack.back()->children.push_back(block);
-            state->blockStack.push_back(block);
-
-            break;
-        }
-        case MD_BLOCK_TBODY:{
-            state->blockStack.back()->children.push_back(block);
-            state->blockStack.push_back(block);
-            break;
-        }
-        case MD_BLOCK_TR: {
-            state->blockStack.back()->children.push_back(block);
-            state->blockStack.push_back(block);
-            break;
-        }
-        case MD_BLOCK_TH: {
-            state->blockStack.back()->children.push_back(block);
-            state->blockStack.push_back(block);
-            break;
-        }
-        case MD_BLOCK_TD: {
-            state->blockStack.back()->children.push_back(block);
-            state->blockStack.push_back(block);
-            break;
+            return 0; // not added, leaveBlockCallback skips it too
         }
+        //blocks without data of their own
+        case MD_BLOCK_DOC:
+        case MD_BLOCK_QUOTE:
+        case MD_BLOCK_HR:
+        case MD_BLOCK_P:
+        case MD_BLOCK_TABLE:
+        case MD_BLOCK_THEAD:
+        case MD_BLOCK_TBODY:
+        case MD_BLOCK_TR:
+        case MD_BLOCK_TH:
+        case MD_BLOCK_TD:
         default:
             break;
     }
+    tree->openBlock(std::move(block));
 
     return 0;
 }
 
 int LatexLabel::leaveBlockCallback(MD_BLOCKTYPE type, void* detail, void* userdata) {
-    struct ExtendedParserState {
-        MarkdownParserState* state;
-        LatexLabel* label;
-    };
-    ExtendedParserState* extState = static_cast<ExtendedParserState*>(userdata);
-    MarkdownParserState* state = extState->state;
+    MarkdownParserState* state = static_cast<MarkdownParserState*>(userdata);
 
-    if( type==MD_BLOCK_DOC){
-        state->segments=state->blockStack.back()->children;
+    if(type == MD_BLOCK_HTML){
+        return 0;
     }
-    else if(type == MD_BLOCK_CODE){
-        if(!state->blockStack.back()->children.empty()) {
-            state->blockStack.back()->children.pop_back(); // remove final \n
-        }
+    if(type == MD_BLOCK_CODE){
+        state->tree->dropLastChild(); // remove final \n
     }
-
-    state->blockStack.pop_back();
+    //the document's children are picked up by parseChunk once md4c is done
+    state->tree->closeBlock();
 
 
     return 0;
 }
 
 int LatexLabel::enterSpanCallback(MD_SPANTYPE type, void* detail, void* userdata) {
-    struct ExtendedParserState {
-        MarkdownParserState* state;
-        LatexLabel* label;
-    };
-    ExtendedParserState* extState = static_cast<ExtendedParserState*>(userdata);
-    MarkdownParserState* state = extState->state;
+    MarkdownParserState* state = static_cast<MarkdownParserState*>(userdata);
     spantype span_type = spantype::normal;
 
     switch(type) {
@@ -259,12 +350,10 @@ int LatexLabel::enterSpanCallback(MD_SPANTYPE type, void* detail, void* userdata
             span_type = spantype::italic;
             break;
         case MD_SPAN_STRONG:
-            if(!state->spanStack.empty()&&SPANTYPE(state->spanStack.back())==spantype::italic){
+            if(!state->spanStack.empty()&&SPANTYPE(&state->tree->building(state->spanStack.back()))==spantype::italic){
                 //replace both with italic_bold span
-                state->blockStack.back()->children.pop_back();
-                Element* ital = state->spanStack.back();
+                state->tree->dropLastChild();
                 state->spanStack.pop_back();
-                delete ital;
                 span_type = spantype::italic_bold;
                 break;
             }
@@ -276,19 +365,17 @@ int LatexLabel::enterSpanCallback(MD_SPANTYPE type, void* detail, void* userdata
             if(detail) {
                 MD_SPAN_A_DETAIL* a_detail = (MD_SPAN_A_DETAIL*)detail;
                 if(a_detail->href.text) {
-                    data.url = QString::fromUtf8(a_detail->href.text, a_detail->href.size);
+                    data.url = in_source(*state, a_detail->href.text, a_detail->href.size);
                 }
                 if(a_detail->title.text) {
-                    data.title = QString::fromUtf8(a_detail->title.text, a_detail->title.size);
+                    data.title = in_source(*state, a_detail->title.text, a_detail->title.size);
                 }
             }
             else{
-                data.url = "Error parsing link";
-                data.title = "Error parsing link";
+                data.url.literal = "Error parsing link";
+                data.title.literal = "Error parsing link";
             }
-            Element* span = new Element(DisplayType::span, data, spantype::hyperlink);
-            state->blockStack.back()->children.push_back(span);
-            state->spanStack.push_back(span);
+            state->spanStack.push_back(state->tree->addChild(Element(DisplayType::span, data, spantype::hyperlink)));
             return 0;
         }
         case MD_SPAN_IMG:
@@ -305,20 +392,14 @@ int LatexLabel::enterSpanCallback(MD_SPANTYPE type, void* detail, void* userdata
             latex_data data;
             data.isInline=true;
             data.render = nullptr;
-            data.text = "";
-            Element* span = new Element(DisplayType::span, data, spantype::latex);
-            state->blockStack.back()->children.push_back(span);
-            state->spanStack.push_back(span);
+            state->spanStack.push_back(state->tree->addChild(Element(DisplayType::span, data, spantype::latex)));
             return 0;
         }
         case MD_SPAN_LATEXMATH_DISPLAY:{
             latex_data data;
             data.isInline=false;
             data.render = nullptr;
-            data.text = "";
-            Element* span = new Element(DisplayType::span, data, spantype::latex);
-            state->blockStack.back()->children.push_back(span);
-            state->spanStack.push_back(span);
+            state->spanStack.push_back(state->tree->addChild(Element(DisplayType::span, data, spantype::latex)));
             return 0;
         }
         case MD_SPAN_WIKILINK:
@@ -330,28 +411,20 @@ int LatexLabel::enterSpanCallback(MD_SPANTYPE type, void* detail, void* userdata
     }
 
     span_data data;
-    data.text = "";
-    Element* span = new Element(DisplayType::span, data, span_type);
-    state->blockStack.back()->children.push_back(span);
-    state->spanStack.push_back(span);
+    state->spanStack.push_back(state->tree->addChild(Element(DisplayType::span, data, span_type)));
 
     return 0;
 }
 
 int LatexLabel::leaveSpanCallback(MD_SPANTYPE type, void* detail, void* userdata) {
-    struct ExtendedParserState {
-        MarkdownParserState* state;
-        LatexLabel* label;
-    };
-    ExtendedParserState* extState = static_cast<ExtendedParserState*>(userdata);
-    MarkdownParserState* state = extState->state;
+    MarkdownParserState* state = static_cast<MarkdownParserState*>(userdata);
     switch(type) { //some spans don't add to span stack
         case MD_SPAN_IMG:
             return 0;
         case MD_SPAN_WIKILINK:
             return 0;
         case MD_SPAN_STRONG:
-            if(SPANTYPE(state->spanStack.back())==spantype::italic_bold){
+            if(SPANTYPE(&state->tree->building(state->spanStack.back()))==spantype::italic_bold){
                 return 0;
             }
         default:
@@ -363,39 +436,29 @@ int LatexLabel::leaveSpanCallback(MD_SPANTYPE type, void* detail, void* userdata
 }
 
 int LatexLabel::textCallback(MD_TEXTTYPE type, const MD_CHAR* text, MD_SIZE size, void* userdata) {
-    struct ExtendedParserState {
-        MarkdownParserState* state;
-        LatexLabel* label;
-    };
-    ExtendedParserState* extState = static_cast<ExtendedParserState*>(userdata);
-    MarkdownParserState* state = extState->state;
-    LatexLabel* label = extState->label;
+    MarkdownParserState* state = static_cast<MarkdownParserState*>(userdata);
+    if(state->cancelled()) return 1;
 
-    QString textStr = QString::fromUtf8(text, size);
-    label->m_raw_text+=textStr;
     if(state->spanStack.empty()){ //no open span, add to recent block element
-        Element* block= state->blockStack.back();
+        ElementTree* tree = state->tree;
 
         span_data data;
         switch(type) {
             case MD_TEXT_NORMAL:{
-                data.text = textStr;
-                Element* t = new Element(DisplayType::span,data,spantype::normal);
-                block->children.push_back(t);
+                data.text = in_source(*state, text, size);
+                tree->addChild(Element(DisplayType::span,data,spantype::normal));
 
             }
                 break;
             case MD_TEXT_NULLCHAR:{
 
-                data.text = QChar(0xFFFD); // Unicode replacement character
-                Element* t = new Element(DisplayType::span,data,spantype::normal);
-                block->children.push_back(t);
+                data.text.literal = QString(QChar(0xFFFD)); // Unicode replacement character
+                tree->addChild(Element(DisplayType::span,data,spantype::normal));
             }
                 break;
             case MD_TEXT_BR:{
 
-                Element* t = new Element(DisplayType::span,data,spantype::linebreak);
-                block->children.push_back(t);
+                tree->addChild(Element(DisplayType::span,data,spantype::linebreak));
             }
                 break;
             case MD_TEXT_SOFTBR:
@@ -406,9 +469,8 @@ int LatexLabel::textCallback(MD_TEXTTYPE type, const MD_CHAR* text, MD_SIZE size
                 return 0; // ignore entity
                 break;
             case MD_TEXT_CODE:{
-                data.text = textStr;
-                Element* t = new Element(DisplayType::span,data,spantype::code);
-                block->children.push_back(t);
+                data.text = in_source(*state, text, size);
+                tree->addChild(Element(DisplayType::span,data,spantype::code));
             }
 
                 break;
@@ -426,20 +488,20 @@ int LatexLabel::textCallback(MD_TEXTTYPE type, const MD_CHAR* text, MD_SIZE size
 
     //we have an open span, fill it with text
 
-    Element* parent_span = state->spanStack.back();
+    Element* parent_span = &state->tree->building(state->spanStack.back());
     ElementData* data_parent=&parent_span->data;
 
     switch(type) {
         case MD_TEXT_NORMAL:
             if(SPANTYPE(parent_span)==spantype::hyperlink){
                 link_data* data=std::get_if<link_data>(data_parent);
-                data->title=textStr;
+                data->title=in_source(*state, text, size);
                 break;
             }
             {
                 span_data* span_data_ptr = std::get_if<span_data>(data_parent);
                 if(span_data_ptr) {
-                    span_data_ptr->text = textStr;
+                    span_data_ptr->text = in_source(*state, text, size);
                 }
             }
             break;
@@ -447,7 +509,8 @@ int LatexLabel::textCallback(MD_TEXTTYPE type, const MD_CHAR* text, MD_SIZE size
             {
                 span_data* span_data_ptr = std::get_if<span_data>(data_parent);
                 if(span_data_ptr) {
-                    span_data_ptr->text = QChar(0xFFFD); // Unicode replacement character
+                    span_data_ptr->text = source_text();
+                    span_data_ptr->text.literal = QString(QChar(0xFFFD)); // Unicode replacement character
                 }
             }
             break;
@@ -462,7 +525,7 @@ int LatexLabel::textCallback(MD_TEXTTYPE type, const MD_CHAR* text, MD_SIZE size
             {
                 span_data* span_data_ptr = std::get_if<span_data>(data_parent);
                 if(span_data_ptr) {
-                    span_data_ptr->text = textStr;
+                    span_data_ptr->text = in_source(*state, text, size);
                 }
             }
             break;
@@ -472,9 +535,7 @@ int LatexLabel::textCallback(MD_TEXTTYPE type, const MD_CHAR* text, MD_SIZE size
             {
                 latex_data* data_latex = std::get_if<latex_data>(data_parent);
                 if(data_latex) {
-                    QRgb argb_color = label->palette().text().color().rgba();
-                    data_latex->render=getLatexRenderer(textStr, data_latex->isInline, state->textSize, argb_color);
-                    data_latex->text=textStr;
+                    data_latex->text=in_source(*state, text, size); //requested once the chunk is parsed, parsing may run off the GUI thread
                 }
             }
             break;
@@ -484,28 +545,9 @@ int LatexLabel::textCallback(MD_TEXTTYPE type, const MD_CHAR* text, MD_SIZE size
     return 0;
 }
 
-void LatexLabel::cleanup_segments(std::vector<Element*>& segments) {
-    for(Element* elem : segments) {
-        if(elem == nullptr) continue;
-        delete elem;
-    }
-    m_segments.clear();
-}
-
-void LatexLabel::parseMarkdown(const QString& text) {
-    //Clean up previous segments
-    cleanup_segments(m_segments);
-
-    // Set up parser state
-    MarkdownParserState state(m_textSize);
-
-
-    // Store a reference to this LatexLabel instance in the state
-    struct ExtendedParserState {
-        MarkdownParserState* state;
-        LatexLabel* label;
-    };
-    ExtendedParserState extendedState = { &state, this };
+int LatexLabel::parseInto(QByteArrayView text, MarkdownParserState& state, std::vector<uint32_t>& segments) {
+    ElementTree& tree = *state.tree;
+    size_t nodes_before = tree.size();
 
     // Set up md4c parser
     MD_PARSER parser = {0};
@@ -517,167 +559,537 @@ void LatexLabel::parseMarkdown(const QString& text) {
     parser.leave_span = leaveSpanCallback;
     parser.text = textCallback;
 
-    // Parse the markdown
-    QByteArray textBytes = text.toUtf8();
-    int result = md_parse(textBytes.constData(), textBytes.size(), &parser, &extendedState);
+    int result = md_parse(text.data(), text.size(), &parser, &state);
+    if(result != 0) {
+        //Clean up any partial parsing results
+        tree.abandon(nodes_before);
+        return result;
+    }
+    Element root = tree.finishDocument();
+    for(uint32_t i = 0; i < root.child_count; i++) {
+        segments.push_back(root.first_child + i);
+    }
+    return 0;
+}
 
-    if(result == 0) {
-        m_curr_code_block=0;
+int LatexLabel::parseParallel(QByteArrayView text, std::span<const qsizetype> splits, MarkdownParserState& state, std::vector<uint32_t>& segments) {
+    //pieces of at least parallel_parse_piece, about one per core
+    int threads = QThread::idealThreadCount();
+    qsizetype piece = std::max(parallel_parse_piece, text.size() / std::max(threads, 1));
+    std::vector<qsizetype> cuts{0};
+    for(qsizetype split : splits) {
+        if(split - cuts.back() >= piece && text.size() - split >= piece / 2) cuts.push_back(split);
+    }
+    if(cuts.size() < 2) return parseInto(text, state, segments);
+    cuts.push_back(text.size());
+
+    //each piece gets its own tree, md4c's callbacks only ever see their own state
+    size_t pieces = cuts.size() - 1;
+    std::vector<ElementTree> trees(pieces);
+    std::vector<std::vector<uint32_t>> piece_segments(pieces);
+    std::vector<int> results(pieces, 0);
+    //the global pool runs other work too, only this call's pieces are waited for
+    QSemaphore done;
+    for(size_t i = 1; i < pieces; i++) {
+        QThreadPool::globalInstance()->start([&, i]() {
+            MarkdownParserState piece_state(&trees[i], state.textSize);
+            piece_state.generation = state.generation;
+            piece_state.expected_generation = state.expected_generation;
+            piece_state.source = state.source;
+            piece_state.source_size = state.source_size;
+            results[i] = parseInto(text.sliced(cuts[i], cuts[i+1] - cuts[i]), piece_state, piece_segments[i]);
+            done.release();
+        });
+    }
+    //the first piece on the calling thread, it would only wait otherwise
+    MarkdownParserState first_state(&trees[0], state.textSize);
+    first_state.generation = state.generation;
+    first_state.expected_generation = state.expected_generation;
+    first_state.source = state.source;
+    first_state.source_size = state.source_size;
+    results[0] = parseInto(text.sliced(0, cuts[1]), first_state, piece_segments[0]);
+    done.acquire(static_cast<int>(pieces - 1));
+
+    for(int result : results) {
+        if(result != 0) return result;
+    }
+    for(size_t i = 0; i < pieces; i++) {
+        uint32_t offset = state.tree->append(std::move(trees[i]));
+        for(uint32_t segment : piece_segments[i]) {
+            segments.push_back(offset + segment);
+        }
+    }
+    return 0;
+}
 
-        m_segments = std::move(state.segments);
+bool LatexLabel::parseChunk(QByteArrayView text, std::span<const qsizetype> splits) {
+    // Set up parser state, elements go straight into the document's tree
+    MarkdownParserState state(&m_tree, m_textSize);
+    state.source = m_source.data();
+    state.source_size = m_source.size();
+    size_t nodes_before = m_tree.size();
+
+    QElapsedTimer timer;
+    timer.start();
+    int result = parseParallel(text, splits, state, m_segments);
+    m_timings.parse_ns += timer.nsecsElapsed();
+    if(result != 0) {
+        qDebug() << "Markdown parsing failed, result code:" << result;
+        return false;
+    }
 
-        //populate m_display_list
-        QFontMetricsF fontMetrics = QFontMetricsF(getFont(font_type::normal));
-        qreal lineHeight = fontMetrics.lineSpacing();
-        qreal x = margin_left;
-        qreal y = margin_top + fontMetrics.ascent();  // y represents the text baseline
-        qreal maxWidth = width() - 10.0;
+    QRgb argb_color = palette().text().color().rgba();
+    for(size_t i = nodes_before; i < m_tree.size(); i++) {
+        Element& element = m_tree[i];
+        if(element.type==DisplayType::span && SPANTYPE(&element)==spantype::latex) {
+            requestLatex(std::get<latex_data>(element.data), argb_color);
+        }
+    }
+    return true;
+}
 
-        for(const Element* segment : m_segments) {
-            if(segment->type==DisplayType::block){
-                renderBlock(*segment, x, y,5.0,width(), lineHeight);
-            }
-            else{
-                renderSpan(*segment, x, y,5.0,width(), lineHeight);
-            }
+bool LatexLabel::parseSnapshot(document_snapshot& snapshot, const std::atomic<uint64_t>* generation) {
+    QElapsedTimer timer;
+    timer.start();
+    MarkdownParserState state(&snapshot.tree, 0);
+    state.generation = generation;
+    state.expected_generation = snapshot.generation;
+    state.source = snapshot.source.data();
+    state.source_size = snapshot.source.size();
+
+    //frozen like parseTail would, so appending after the swap only parses the tail
+    QByteArrayView text = snapshot.source.view();
+    MarkdownSplitScan scan = scanSplitPoints(text);
+    if(!scan.has_reference_definition && !scan.splits.empty()) {
+        qsizetype split = scan.splits.back();
+        std::span<const qsizetype> inner(scan.splits.data(), scan.splits.size() - 1);
+        if(parseParallel(text.sliced(0, split), inner, state, snapshot.segments) == 0) {
+            snapshot.frozen.text_length = split;
+            snapshot.frozen.segments = snapshot.segments.size();
+            snapshot.frozen.nodes = snapshot.tree.size();
+            text = text.sliced(split);
+        }
+        if(state.cancelled()) return false;
+    }
+    MarkdownParserState tail_state(&snapshot.tree, 0);
+    tail_state.generation = generation;
+    tail_state.expected_generation = snapshot.generation;
+    tail_state.source = state.source;
+    tail_state.source_size = state.source_size;
+    parseInto(text, tail_state, snapshot.segments);
+    snapshot.parse_ns = timer.nsecsElapsed();
+    return !tail_state.cancelled();
+}
+
+void LatexLabel::startBackgroundParse() {
+    m_parse_pending = true;
+    m_parse_pool.clear(); //parses that haven't started are superseded already
+    auto snapshot = std::make_shared<document_snapshot>();
+    snapshot->generation = m_parse_generation.load();
+    snapshot->source = m_source;
+    m_parse_pool.start([this, snapshot]() {
+        if(!parseSnapshot(*snapshot, &m_parse_generation)) return; //the parse that replaced it posts instead
+        //dropped with the other posted events if the label is gone by then
+        QMetaObject::invokeMethod(this, [this, snapshot]() {
+            applySnapshot(snapshot);
+        }, Qt::QueuedConnection);
+    });
+}
+
+void LatexLabel::applySnapshot(const std::shared_ptr<document_snapshot>& snapshot) {
+    if(snapshot->generation != m_parse_generation.load()) return; //a later setText
+    m_parse_pending = false;
+    m_shown_source.clear();
+    resetDocumentState();
+    m_tree = std::move(snapshot->tree);
+    m_segments = std::move(snapshot->segments);
+    m_segment_layout.clear();
+    deleteDisplayList();
+    m_frozen = snapshot->frozen;
+    m_timings.parse_ns += snapshot->parse_ns;
+    refreshLatexRenders(palette().text().color().rgba());
+
+    //the snapshot only parsed, layout fills in where the frozen part ends
+    relayout(width());
+    if(m_source.size() > snapshot->source.size()) {
+        //appended to while parsing, the frozen part is still good
+        parseTail();
+    }
+    update();
+    adjustSize();
+}
 
+void LatexLabel::layoutSegments(size_t first, size_t last, qreal& x, qreal& y, qreal max_x) {
+    qreal lineHeight = m_styles[font_type::normal].metrics_f.lineSpacing();
+    QElapsedTimer timer;
+    timer.start();
+
+    //entries after last stay, in virtualized mode they hold the estimates
+    if(m_segment_layout.size() < last) m_segment_layout.resize(last);
+    for(size_t i = first; i < last; i++) {
+        const Element* segment = &m_tree[m_segments[i]];
+        segmentLayout& layout = m_segment_layout[i];
+        layout.fragments = m_display_list.size();
+        layout.code_blocks = m_curr_code_block;
+        layout.x = x;
+        layout.y = y;
+        if(segment->type==DisplayType::block){
+            renderBlock(*segment, x, y,5.0,max_x, lineHeight);
         }
-        widget_height=y;
-        setMinimumHeight(widget_height);
-        updateGeometry();
-    } else {
-        //Clean up any partial parsing results
-        cleanup_segments(state.segments);
-        qDebug() << "Markdown parsing failed, result code:" << result;
+        else{
+            renderSpan(*segment, x, y,5.0,max_x, lineHeight);
+        }
+        layout.height = y - layout.y;
+        layout.code_block_count = m_curr_code_block - layout.code_blocks;
+        layout.measured = true;
     }
+    m_timings.layout_ns += timer.nsecsElapsed();
 }
 
-QFont LatexLabel::getFont(font_type type) const {
-    // Start with the base font
-    QFont font("Arial", m_textSize);
+void LatexLabel::relayoutFrom(size_t first) {
+    if(first >= m_segments.size()) return;
+    if(m_virtualized) {
+        //segments out of view get laid out again when they come back
+        for(size_t i = first; i < m_segments.size(); i++) {
+            if(i < m_realized_first || i >= m_realized_last) m_segment_layout[i].measured = false;
+        }
+        estimateSegments(first);
+        realizeViewport(true);
+        return;
+    }
+    segmentLayout start = m_segment_layout[first];
 
-    switch (type) {
-        case font_type::bold:
-            font.setBold(true);
-            break;
+    //repaint everything the old and the new fragments cover
+    QRect dirty;
+    for(size_t i = start.fragments; i < m_display_list.size(); i++) {
+        dirty |= m_display_list[i].bounding_box;
+    }
 
-        case font_type::italic:
-            font.setItalic(true);
-            break;
+    deleteDisplayList(start.fragments);
+    m_curr_code_block = start.code_blocks;
+    qreal x = start.x;
+    qreal y = start.y;
+    if(first < m_frozen.segments) {
+        layoutSegments(first, m_frozen.segments, x, y, width());
+        m_frozen.fragments = m_display_list.size();
+        m_frozen.code_blocks = m_curr_code_block;
+        m_frozen.x = x;
+        m_frozen.y = y;
+        first = m_frozen.segments;
+    }
+    layoutSegments(first, m_segments.size(), x, y, width());
 
-        case font_type::italic_bold:
-            font.setBold(true);
-            font.setItalic(true);
-            break;
+    for(size_t i = start.fragments; i < m_display_list.size(); i++) {
+        dirty |= m_display_list[i].bounding_box;
+    }
+    widget_height=y;
+    setMinimumHeight(widget_height);
+    updateGeometry();
+    update(QRect(0, dirty.top(), width(), dirty.height()));
+}
 
-        case font_type::mono:
-            font.setFamily("Monaco");
-            break;
-        case font_type::strikethrough:
-                    font.setStrikeOut(true);
-                    break;
+QPointF LatexLabel::layoutOrigin() const {
+    return QPointF(margin_left, margin_top + m_styles[font_type::normal].metrics_f.ascent());
+}
 
-        case font_type::underline:
-        case font_type::hyperlink: // Links are also underlined
-            font.setUnderline(true);
-            break;
+void LatexLabel::relayout(int width) {
+    if(m_virtualized) {
+        //every measurement depends on width and fonts
+        for(segmentLayout& layout : m_segment_layout) {
+            layout.measured = false;
+        }
+        estimateSegments(0);
+        realizeViewport(true);
+        return;
+    }
+    deleteDisplayList();
+    m_curr_code_block = 0;
+    QPointF origin = layoutOrigin();
+    qreal x = origin.x();
+    qreal y = origin.y();
+
+    //frozen fragments move too, keep the streaming bookkeeping in sync
+    layoutSegments(0, m_frozen.segments, x, y, width);
+    m_frozen.fragments = m_display_list.size();
+    m_frozen.code_blocks = m_curr_code_block;
+    m_frozen.x = x;
+    m_frozen.y = y;
+    layoutSegments(m_frozen.segments, m_segments.size(), x, y, width);
+
+    widget_height=y;
+    setMinimumHeight(widget_height);
+    updateGeometry();
+}
 
-        // Handle all heading levels
-        case font_type::heading1:
-        case font_type::heading2:
-        case font_type::heading3:
-        case font_type::heading4:
-        case font_type::heading5:
-        case font_type::heading6:
-        {
-            int level = 0;
-            if (type == font_type::heading1) level = 1;
-            else if (type == font_type::heading2) level = 2;
-            else if (type == font_type::heading3) level = 3;
-            else if (type == font_type::heading4) level = 4;
-            else if (type == font_type::heading5) level = 5;
-            else if (type == font_type::heading6) level = 6;
-            // Original formula: textSize + (6 - level) * 4
-            int headingSize = std::max(8, m_textSize + (6 - level) * 4);
-            font.setPointSize(headingSize);
-            font.setBold(true);
-            break;
+// Characters of the spans directly under element, formulas count half like their placeholders
+static qsizetype span_text_length(const ElementTree& tree, const Element& element) {
+    qsizetype length = 0;
+    for(const Element& child : tree.children(element)) {
+        if(child.type != DisplayType::span) continue;
+        if(const span_data* data = std::get_if<span_data>(&child.data)) {
+            length += data->text.range.length + data->text.literal.size(); //bytes, close enough for an estimate
         }
+        else if(const latex_data* data = std::get_if<latex_data>(&child.data)) {
+            length += (data->text.range.length + data->text.literal.size()) / 2;
+        }
+        length += span_text_length(tree, child);
+    }
+    return length;
+}
+
+qreal LatexLabel::estimateHeight(const Element& block, qreal width, int& code_blocks) const {
+    const textStyle& normal = m_styles[font_type::normal];
+    qreal lineHeight = normal.metrics_f.lineSpacing();
+    auto lines = [&](const textStyle& style, qreal available) {
+        qreal advance = span_text_length(m_tree, block) * style.metrics_f.averageCharWidth();
+        return std::max<qreal>(1, std::ceil(advance / std::max<qreal>(available, 50)));
+    };
 
-        case font_type::normal:
+    //follows the spacing of the render functions, code blocks and rules come out exact
+    switch(block.block_type) {
+        case MD_BLOCK_CODE: {
+            code_blocks++;
+            std::span<const Element> children = m_tree.children(block);
+            int line_breaks = 0;
+            for(const Element& child : children) {
+                if(sourceText(std::get<span_data>(child.data).text) == "\n" && &child != &children.back()) line_breaks++;
+            }
+            int header_height = normal.metrics.height() + 2*8;
+            return header_height + 10 + (line_breaks + 1) * m_styles[font_type::mono].metrics.lineSpacing() + 40;
+        }
+        case MD_BLOCK_HR:
+            return 4 * lineHeight;
+        case MD_BLOCK_H: {
+            const textStyle& heading = m_styles[StyleTable::styleOf(block)];
+            qreal headingLineHeight = heading.metrics_f.lineSpacing();
+            return (lines(heading, width) + 0.6) * headingLineHeight;
+        }
+        case MD_BLOCK_P:
+            return (lines(normal, width) - 1) * lineHeight + normal.metrics_f.height();
+        case MD_BLOCK_TABLE: {
+            int rows = 0;
+            for(const Element& section : m_tree.children(block)) {
+                rows += section.child_count;
+            }
+            return 10 + rows * (normal.height + 10);
+        }
+        case MD_BLOCK_QUOTE:
+            return 0; //not rendered yet
+        case MD_BLOCK_LI: {
+            qreal available = width - 2 * normal.metrics_f.averageCharWidth();
+            qreal height = 0;
+            bool has_text = span_text_length(m_tree, block) > 0;
+            bool last_is_list = false;
+            if(has_text) height += (lines(normal, available) - 1) * lineHeight;
+            for(const Element& child : m_tree.children(block)) {
+                if(child.type != DisplayType::block) continue;
+                if(has_text) height += lineHeight;
+                height += estimateHeight(child, available, code_blocks);
+                last_is_list = child.block_type == MD_BLOCK_UL || child.block_type == MD_BLOCK_OL;
+            }
+            if(!last_is_list) height += lineHeight * 1.1;
+            return height;
+        }
+        case MD_BLOCK_DOC:
+        case MD_BLOCK_UL:
+        case MD_BLOCK_OL: {
+            qreal height = 0;
+            for(const Element& child : m_tree.children(block)) {
+                if(child.type == DisplayType::block) height += estimateHeight(child, width, code_blocks);
+            }
+            return height;
+        }
         default:
-            // Do nothing, use the default font
-            break;
+            return (lines(normal, width) - 1) * lineHeight;
     }
+}
 
-    return font;
+void LatexLabel::estimateSegments(size_t first) {
+    m_segment_layout.resize(m_segments.size());
+    qreal available = std::max(width(), 200) - 10.0;
+    for(size_t i = first; i < m_segments.size(); i++) {
+        segmentLayout& layout = m_segment_layout[i];
+        if(layout.measured) continue;
+        int code_blocks = 0;
+        layout.height = estimateHeight(m_tree[m_segments[i]], available, code_blocks);
+        layout.code_block_count = code_blocks;
+    }
+    updatePositions(first);
 }
-QFont LatexLabel::getFont(const Element* segment) const {
-    QFont font("Arial", m_textSize);
 
-    if(segment->type==DisplayType::block&&BLOCKTYPE(segment)==MD_BLOCK_H){
-        heading_data data = std::get<heading_data>(segment->data);
-        int headingSize = std::max(8, m_textSize + (6 - data.level) * 4);
-        font.setPointSize(headingSize);
-        font.setBold(true);
+void LatexLabel::updatePositions(size_t first) {
+    QPointF origin = layoutOrigin();
+    for(size_t i = first; i < m_segment_layout.size(); i++) {
+        segmentLayout& layout = m_segment_layout[i];
+        layout.x = origin.x(); //every top-level block ends back at the left margin
+        if(i == 0) {
+            layout.y = origin.y();
+            layout.code_blocks = 0;
+        }
+        else {
+            const segmentLayout& previous = m_segment_layout[i-1];
+            layout.y = previous.y + previous.height;
+            layout.code_blocks = previous.code_blocks + previous.code_block_count;
+        }
     }
-    else if (segment->type==DisplayType::block&&BLOCKTYPE(segment)==MD_BLOCK_CODE){
-        font.setFamily("Monaco");
+    widget_height = m_segment_layout.empty() ? origin.y() : m_segment_layout.back().y + m_segment_layout.back().height;
+}
+
+size_t LatexLabel::segmentAt(qreal y) const {
+    auto it = std::upper_bound(m_segment_layout.begin(), m_segment_layout.end(), y, [](qreal value, const segmentLayout& layout) {
+        return value < layout.y;
+    });
+    return it == m_segment_layout.begin() ? 0 : it - m_segment_layout.begin() - 1;
+}
+
+QRect LatexLabel::viewportRect() const {
+    if(!parentWidget()) return rect();
+    //inside a scroll area the parent is the viewport and this widget is moved up as it scrolls
+    return QRect(-pos(), parentWidget()->size()) & rect();
+}
+
+QAbstractScrollArea* LatexLabel::scrollArea() const {
+    QWidget* viewport = parentWidget();
+    if(!viewport) return nullptr;
+    QAbstractScrollArea* area = qobject_cast<QAbstractScrollArea*>(viewport->parentWidget());
+    return area && area->viewport() == viewport ? area : nullptr;
+}
+
+void LatexLabel::realizeViewport(bool force) {
+    if(!m_virtualized || m_realizing) return;
+    if(parentWidget() != m_watched_viewport) {
+        //the viewport can grow without this widget changing size
+        if(m_watched_viewport) m_watched_viewport->removeEventFilter(this);
+        m_watched_viewport = parentWidget();
+        if(m_watched_viewport) m_watched_viewport->installEventFilter(this);
     }
-    else if(segment->type==DisplayType::span){
 
-        switch (SPANTYPE(segment)) {
-            case spantype::bold:
-                font.setBold(true);
-                break;
-            case spantype::italic:
-                font.setItalic(true);
-                break;
-            case spantype::underline:
-                font.setUnderline(true);
-                break;
-            case spantype::hyperlink:
-                font.setUnderline(true);
-                break;
-            case spantype::strikethrough:
-                font.setStrikeOut(true);
-                break;
-            case spantype::code:
-                font.setFamily("Monaco");
-                break;
-            case spantype::italic_bold:
-                font.setBold(true);
-                font.setItalic(true);
-                break;
-            default:
-                break;
-        }
+    QRect visible = viewportRect();
+    size_t first = segmentAt(visible.top() - m_realize_margin);
+    size_t last = std::min(segmentAt(visible.bottom() + m_realize_margin) + 1, m_segments.size());
+    if(!force && first == m_realized_first && last == m_realized_last) return;
+
+    //the segment at the top of the viewport is the anchor, corrections above it must not move it on screen
+    size_t anchor = segmentAt(visible.top());
+    qreal anchor_y = anchor < m_segment_layout.size() ? m_segment_layout[anchor].y : 0;
+
+    m_realizing = true;
+    deleteDisplayList();
+    m_realized_first = first;
+    m_realized_last = last;
+    int first_block = 0;
+    if(first < last) {
+        first_block = m_segment_layout[first].code_blocks;
+        m_curr_code_block = first_block;
+        qreal x = m_segment_layout[first].x;
+        qreal y = m_segment_layout[first].y;
+        layoutSegments(first, last, x, y, width());
+    }
+    //code blocks out of view keep their scroll but not their button
+    for(int i = 0; i < (int)m_code_block_info.size(); i++) {
+        if(first < last && i >= first_block && i < m_curr_code_block) continue;
+        m_code_block_info[i].button = QRect();
+        m_code_block_info[i].boundingBox = QRect();
+    }
+    updatePositions(first);
+
+    setMinimumHeight(widget_height);
+    if(height() < widget_height) resize(width(), widget_height); //scroll range has to cover the anchor before scrolling to it
+    updateGeometry();
+
+    int shift = anchor < m_segment_layout.size() ? qRound(m_segment_layout[anchor].y - anchor_y) : 0;
+    QAbstractScrollArea* area = scrollArea();
+    if(shift != 0 && area) {
+        QScrollBar* bar = area->verticalScrollBar();
+        bar->setValue(bar->value() + shift);
     }
+    m_realizing = false;
+    update();
+    if(shift != 0 && area) {
+        realizeViewport(false); //the viewport moved, it may need more segments
+    }
+}
 
-    return font;
+void LatexLabel::parseMarkdown() {
+    //nothing is frozen anymore, the tail is the whole document
+    m_frozen = frozenPrefix();
+    parseTail();
 }
 
+void LatexLabel::parseTail() {
+    //Drop everything after the frozen prefix
+    m_segments.resize(m_frozen.segments);
+    m_segment_layout.resize(m_frozen.segments);
+    m_tree.truncate(m_frozen.nodes);
+    deleteDisplayList(m_frozen.fragments);
+    m_curr_code_block = m_frozen.code_blocks;
+    if(m_frozen.text_length == 0) {
+        QPointF origin = layoutOrigin(); // y represents the text baseline
+        m_frozen.x = origin.x();
+        m_frozen.y = origin.y();
+    }
+
+    size_t first_new = m_segments.size();
+    qreal x = m_frozen.x;
+    qreal y = m_frozen.y;
+    QByteArrayView tail = m_source.view().sliced(m_frozen.text_length);
+    MarkdownSplitScan scan = scanSplitPoints(tail);
+
+    if(scan.has_reference_definition && m_frozen.text_length > 0) {
+        //a reference definition in the tail can change links in frozen blocks
+        parseMarkdown();
+        return;
+    }
+
+    if(!scan.has_reference_definition && !scan.splits.empty()) {
+        //everything before the last closed top-level block won't change anymore
+        qsizetype split = scan.splits.back();
+        if(parseChunk(tail.sliced(0, split), std::span<const qsizetype>(scan.splits.data(), scan.splits.size() - 1))) {
+            if(!m_virtualized) layoutSegments(m_frozen.segments, m_segments.size(), x, y, width());
+            m_frozen.text_length += split;
+            m_frozen.segments = m_segments.size();
+            m_frozen.nodes = m_tree.size();
+            m_frozen.fragments = m_display_list.size();
+            m_frozen.code_blocks = m_curr_code_block;
+            m_frozen.x = x;
+            m_frozen.y = y;
+            tail = tail.sliced(split);
+        }
+    }
 
+    bool parsed = parseChunk(tail);
+    if(m_virtualized) {
+        estimateSegments(first_new);
+        realizeViewport(true);
+        return;
+    }
+    if(parsed) {
+        layoutSegments(m_frozen.segments, m_segments.size(), x, y, width());
+    }
+
+    widget_height=y;
+    setMinimumHeight(widget_height);
+    updateGeometry();
+}
+
+const textStyle& LatexLabel::textStyleOf(const Element* segment) const {
+    return m_styles[StyleTable::styleOf(*segment)];
+}
 
 qreal LatexLabel::getLineHeight(const Element& segment, const QFontMetricsF& metrics) const {
-    if (segment.type==DisplayType::block&& *((MD_BLOCKTYPE*)segment.subtype)==MD_BLOCK_H) {
+    if (segment.type==DisplayType::block&& segment.block_type==MD_BLOCK_H) {
         return metrics.height() * 1.2; // Extra spacing for headings
-    } else if (segment.type==DisplayType::block&& *((MD_BLOCKTYPE*)segment.subtype)==MD_BLOCK_CODE) {
+    } else if (segment.type==DisplayType::block&& segment.block_type==MD_BLOCK_CODE) {
         return metrics.height() * 1.1; // Slight extra spacing for code blocks
     }
 
     return metrics.height();
 }
 
-void LatexLabel::renderSpan(const Element& segment, qreal& x, qreal& y, qreal min_x,qreal max_x, qreal lineHeight,QFont* font_passed) {
-    QFont font;
-    if(font_passed){
-        font=*font_passed;
-    }
-    else{
-        font = getFont(&segment);
-    }
-    spantype type = *(spantype*)segment.subtype;
+void LatexLabel::renderSpan(const Element& segment, qreal& x, qreal& y, qreal min_x,qreal max_x, qreal lineHeight,const font_type* style_passed) {
+    font_type style_id = style_passed ? *style_passed : StyleTable::styleOf(segment);
+    const textStyle& text_style = m_styles[style_id];
+    spantype type = segment.span_type;
     QPalette::ColorRole colorRole;
     switch(type) {
         case spantype::hyperlink:
@@ -693,7 +1105,7 @@ void LatexLabel::renderSpan(const Element& segment, qreal& x, qreal& y, qreal mi
 
 
 
-    QFontMetrics metrics(font);
+    const QFontMetrics& metrics = text_style.metrics;
 
 
 
@@ -705,11 +1117,12 @@ void LatexLabel::renderSpan(const Element& segment, qreal& x, qreal& y, qreal mi
     }
 
 
-    // Handle LaTeX math
-    if(type == spantype::latex) {
-        latex_data data = std::get<latex_data>(segment.data);
-        qreal renderWidth = data.render->getWidth();
-        qreal renderHeight = data.render->getHeight();
+    // Handle LaTeX math, formulas that failed to parse are shown as their source
+    const latex_data* latex = std::get_if<latex_data>(&segment.data);
+    if(type == spantype::latex && (latex->render || latex->stored || latex->pending)) {
+        const latex_data& data = *latex;
+        int renderWidth, renderHeight, renderDepth;
+        latexExtent(data, metrics, renderWidth, renderHeight, renderDepth);
 
         if(data.isInline&& x+renderWidth>max_x){
             //inline latex, check if it fits on line
@@ -722,16 +1135,14 @@ void LatexLabel::renderSpan(const Element& segment, qreal& x, qreal& y, qreal mi
             x=(max_x-min_x)/2-renderWidth/2;
         }
 
-        // Draw LaTeX expression
-        qreal latexY = y - (renderHeight - data.render->getDepth());
-        int width=data.render->getWidth();
-        int height= data.render->getHeight();
-        addLatex(x, latexY, width, height, data.render, data.text, data.isInline);
+        // Draw LaTeX expression, or reserve its space until the worker is done
+        qreal latexY = y - (renderHeight - renderDepth);
+        addLatex(x, latexY, renderWidth, renderHeight, data.render, sourceText(data.text), data.isInline, data.stored);
 
 
 
         if(data.isInline){
-            x += renderWidth + metrics.horizontalAdvance(" ");
+            x += renderWidth + text_style.space_advance;
         }
         else{
             x = min_x;
@@ -743,12 +1154,14 @@ void LatexLabel::renderSpan(const Element& segment, qreal& x, qreal& y, qreal mi
 
 
     QString text;
-    if(type!=spantype::hyperlink){
-        text = std::get<span_data>(segment.data).text;
+    if(type==spantype::latex){
+        text = sourceText(latex->text);
+    }
+    else if(type!=spantype::hyperlink){
+        text = sourceText(std::get<span_data>(segment.data).text);
     }
     else{
-        link_data link_infos= std::get<link_data>(segment.data);
-        text=link_infos.url;
+        text = sourceText(std::get<link_data>(segment.data).url);
     }
 
 
@@ -756,41 +1169,59 @@ void LatexLabel::renderSpan(const Element& segment, qreal& x, qreal& y, qreal mi
 
     QStringList words = text.split(' ', Qt::SkipEmptyParts);
 
+    //words are wrapped one by one, but every run of them that ends up on the same line becomes one fragment
+    QString run;
+    qreal run_x = x;
+    int run_width = 0;
+    auto flush_run = [&]() {
+        if(run.isEmpty()) return;
+        addText(run_x, y-text_style.ascent, run_width+1, text_style.height, run, style_id, colorRole);
+        run.clear();
+    };
     for(const QString& word : words) {
         if(word=="\n"){
+            flush_run();
             x = min_x;
-            y += metrics.lineSpacing();
+            y += text_style.line_spacing;
             continue;
         }
         //Calculate word width
-        int wordWidth = metrics.horizontalAdvance(word);
-        int spaceWidth = metrics.horizontalAdvance(" ");
-        int totalWidth = wordWidth + spaceWidth;
+        int wordWidth = m_styles.advance(style_id, word);
+        int totalWidth = wordWidth + text_style.space_advance;
 
         //Check if word fits on current line
         if(x + totalWidth > max_x) {
+            flush_run();
             x = min_x;
-            y += metrics.lineSpacing();
+            y += text_style.line_spacing;
+        }
+        if(run.isEmpty()) {
+            run_x = x;
+            run = word;
+            run_width = wordWidth;
+        }
+        else {
+            run += ' ';
+            run += word;
+            run_width = x + wordWidth - run_x;
         }
-        addText(x, y-metrics.ascent(), wordWidth+1, metrics.height(), word, font, colorRole);
         x += totalWidth;
     }
+    flush_run();
 }
 
 
 void LatexLabel::renderBlock(const Element& segment, qreal& x, qreal& y, qreal min_x,qreal max_x, qreal& lineHeight){
-    QFont font = getFont(&segment);
-    QFontMetricsF metrics(font);
-    qreal currentLineHeight = getLineHeight(segment, metrics);
+    qreal currentLineHeight = getLineHeight(segment, textStyleOf(&segment).metrics_f);
 
-    switch(*(MD_BLOCKTYPE*)segment.subtype) {
+    switch(segment.block_type) {
         case MD_BLOCK_DOC:
             // Document block - render all children
-            for(const Element* child : segment.children) {
-                if(child->type==DisplayType::block) {
-                    renderBlock(*child, x, y, min_x,max_x, lineHeight);
+            for(const Element& child : m_tree.children(segment)) {
+                if(child.type==DisplayType::block) {
+                    renderBlock(child, x, y, min_x,max_x, lineHeight);
                 } else {
-                    renderSpan(*child, x, y, min_x,max_x, lineHeight);
+                    renderSpan(child, x, y, min_x,max_x, lineHeight);
                 }
             }
             break;
@@ -814,15 +1245,14 @@ void LatexLabel::renderBlock(const Element& segment, qreal& x, qreal& y, qreal m
         case MD_BLOCK_HR:{
             // Draw horizontal line
             y += 2*lineHeight;
-            addLine(x, y, width()-5, y, QPoint(width()-5, y));
+            addLine(x, y, max_x-5, y, QPoint(max_x-5, y));
             y += 2*lineHeight;
             break;
         }
         case MD_BLOCK_P:
             {
-                QFont baseFont("Arial", m_textSize);
-                for(const Element* child : segment.children) {
-                        renderSpan(*child, x, y,min_x,max_x, lineHeight);
+                for(const Element& child : m_tree.children(segment)) {
+                        renderSpan(child, x, y,min_x,max_x, lineHeight);
                 }
                 x = min_x;
                 y += currentLineHeight;
@@ -832,8 +1262,8 @@ void LatexLabel::renderBlock(const Element& segment, qreal& x, qreal& y, qreal m
             // Default block rendering
             {
                 qDebug()<<"using default block rendering";
-                for(const auto& child : segment.children) {
-                    renderSpan(*child, x, y,min_x,max_x, lineHeight);
+                for(const Element& child : m_tree.children(segment)) {
+                    renderSpan(child, x, y,min_x,max_x, lineHeight);
                 }
             }
             break;
@@ -842,13 +1272,13 @@ void LatexLabel::renderBlock(const Element& segment, qreal& x, qreal& y, qreal m
 
 void LatexLabel::renderListElement(const Element& segment, qreal& x, qreal& y, int min_x,int max_x, qreal& lineHeight) {
 
-    MD_BLOCKTYPE type =*(MD_BLOCKTYPE*)segment.subtype;
+    MD_BLOCKTYPE type =segment.block_type;
 
 
     if(type==MD_BLOCK_LI) {
         list_item_data data =std::get<list_item_data>(segment.data);
         //draw list marker
-        QFont baseFont("Arial", m_textSize);
+        const textStyle& base_style = m_styles[font_type::normal];
 
 
 
@@ -861,9 +1291,8 @@ void LatexLabel::renderListElement(const Element& segment, qreal& x, qreal& y, i
             marker = "• "; //TODO: replace with actual markers
         }
         //adjust x position based on marker width
-        QFontMetrics metrics(baseFont);
-        qreal markerWidth = metrics.horizontalAdvance(marker);
-        addText(x, y-metrics.ascent(), markerWidth, metrics.height(), marker, baseFont, QPalette::Text);
+        qreal markerWidth = base_style.metrics.horizontalAdvance(marker);
+        addText(x, y-base_style.ascent, markerWidth, base_style.height, marker, font_type::normal, QPalette::Text);
 
 
         x += markerWidth + 2.0;
@@ -874,20 +1303,19 @@ void LatexLabel::renderListElement(const Element& segment, qreal& x, qreal& y, i
 
 
         // Render list item content
-        QFont listFont("Arial", m_textSize);
         bool last_rendered_is_list=false;
-        for(const Element* child : segment.children) {
+        for(const Element& child : m_tree.children(segment)) {
             last_rendered_is_list=false;
-            if(child->type==DisplayType::span) {
-                renderSpan(*child, x, y, left_border,max_x, lineHeight);
+            if(child.type==DisplayType::span) {
+                renderSpan(child, x, y, left_border,max_x, lineHeight);
             }
             else{
-                last_rendered_is_list=BLOCKTYPE(child)==MD_BLOCK_UL||BLOCKTYPE(child)==MD_BLOCK_OL;
+                last_rendered_is_list=BLOCKTYPE(&child)==MD_BLOCK_UL||BLOCKTYPE(&child)==MD_BLOCK_OL;
                 if(x>left_border){
                     x=left_border;
                     y+=lineHeight;
                 }
-                renderBlock(*child, x, y, left_border,max_x, lineHeight);
+                renderBlock(child, x, y, left_border,max_x, lineHeight);
             }
         }
         if(!last_rendered_is_list){
@@ -897,9 +1325,9 @@ void LatexLabel::renderListElement(const Element& segment, qreal& x, qreal& y, i
         x = min_x;
     } else {
         // List container - render children
-        for(const Element* child : segment.children) {
-            if(child->type==DisplayType::block) {
-                renderBlock(*child, x, y, min_x,max_x, lineHeight);
+        for(const Element& child : m_tree.children(segment)) {
+            if(child.type==DisplayType::block) {
+                renderBlock(child, x, y, min_x,max_x, lineHeight);
             }
         }
         x=min_x;
@@ -908,10 +1336,8 @@ void LatexLabel::renderListElement(const Element& segment, qreal& x, qreal& y, i
 
 void LatexLabel::renderHeading(const Element& segment, qreal& x, qreal& y, qreal min_x,qreal max_x, qreal& lineHeight) {
 
-    QFont font = getFont(&segment);
-    QFontMetricsF metrics(font);
-
-    qreal headingLineHeight = metrics.lineSpacing();
+    font_type heading_style = StyleTable::styleOf(segment);
+    qreal headingLineHeight = m_styles[heading_style].metrics_f.lineSpacing();
 
     // Add more spacing before heading (move to next line if not at start)
     if(x > min_x) {
@@ -922,8 +1348,8 @@ void LatexLabel::renderHeading(const Element& segment, qreal& x, qreal& y, qreal
 
 
     // Render heading content with heading font inherited
-    for(const Element* child : segment.children) {
-        renderSpan(*child, x, y, min_x,max_x, headingLineHeight,&font);
+    for(const Element& child : m_tree.children(segment)) {
+        renderSpan(child, x, y, min_x,max_x, headingLineHeight,&heading_style);
     }
 
     // Add spacing after heading and move to next line
@@ -951,7 +1377,7 @@ void LatexLabel::wheelEvent(QWheelEvent *event){
             else{
                 info.shift+=event->angleDelta().x();
             }
-            update(info.boundingBox);
+            invalidateArea(info.boundingBox);
             continue;
         }
     }
@@ -965,92 +1391,51 @@ void LatexLabel::renderCodeBlock(const Element& segment, qreal& x, qreal& y, qre
     int code_padding=10;
     int header_padding=8;
 
-    QFont font = getFont(&segment);
-    QFont header_font("Arial",m_textSize);
-
-
-
-
-
-    QFontMetrics fm_header(header_font);
+    const QFontMetrics& fm_header = m_styles[font_type::normal].metrics;
     int header_height = fm_header.height()+2*header_padding;
 
+    //virtualized layout can start at any block, the ones before it are filled in when they are laid out
+    if(m_curr_code_block >= m_code_block_info.size()){
+        m_code_block_info.resize(m_curr_code_block+1);
+    }
+    layoutInfoCodeBlock& info = m_code_block_info.at(m_curr_code_block); //laid out again, the scroll is kept
+    const QFontMetrics& fm = m_styles[font_type::mono].metrics;
+    indexCodeLines(info, segment, fm);
+    unsigned line_count = info.line_count;
+
     //draw background
-    unsigned line_count = 1;
-    QString text;
-    for(const Element* child :segment.children){
-        QString child_text=std::get<span_data> (child->data).text;
-        text+=child_text;
-        if(child_text=="\n")
-            line_count++;
-    }
-    QFont code_font("Monaco",m_textSize);
-    QFontMetrics fm(code_font);
     int content_height=fm.ascent()+fm.lineSpacing()*line_count;
     addRoundedRect(x,y,max_x-2*x,content_height+header_height, 10, QPalette::ColorRole::Base,QPalette::ColorRole::Mid);
     //draw header
     addRoundedRect(x, y, max_x-2*x, header_height, 10, 10, 0, 0, QPalette::ColorRole::Mid,QPalette::ColorRole::Mid);
-    QString language_name= std::get<code_block_data>(segment.data).language;
+    QString language_name= sourceText(std::get<code_block_data>(segment.data).language);
     if(language_name==""){
         language_name=QString("%1 Lines").arg(line_count);
     }
-    addText(x+header_padding, y+header_height/2.0 - fm_header.height()/2.0, fm_header.horizontalAdvance(language_name), fm_header.height(), language_name, header_font, QPalette::HighlightedText);
-    QPushButton* copy_button;
-    int button_width = 50;
-    int button_height = 20;
+    addText(x+header_padding, y+header_height/2.0 - fm_header.height()/2.0, fm_header.horizontalAdvance(language_name), fm_header.height(), language_name, font_type::normal, QPalette::HighlightedText);
+    //Copy button, painted and hit tested by the label, a code block costs no widget
+    int button_width = fm_header.horizontalAdvance("Copy") + 2*header_padding;
+    int button_height = fm_header.height() + 4;
     int button_padding=(header_height-button_height)/2;
     int buttonX = max_x - x - button_width-button_padding;
     QRect total_bounding_box(x,y,max_x-2*x,content_height+header_height); //bounding box of entire widget
-    if(m_curr_code_block < m_code_block_info.size()){ //just updating the layout
-        m_code_block_info[m_curr_code_block].boundingBox = total_bounding_box;
-        copy_button=m_code_block_info[m_curr_code_block].button;
-    } else {
-        layoutInfoCodeBlock info;
-        info.shift=0;
-        info.isOverflowing=false;
-        info.boundingBox=total_bounding_box;
-
-        copy_button=new QPushButton("Copy", this);
-        connect(copy_button, &QPushButton::clicked, this, [text]() {
-            QGuiApplication::clipboard()->setText(text);
-        });
-        copy_button->setStyleSheet(QString("QPushButton { background-color: palette(button); border-radius: %1px; padding: 2px; } QPushButton:hover { background-color: palette(light); }").arg(5));
-        copy_button->show();
-        info.button=copy_button;
-
-        m_code_block_info.push_back(info);
-    }
-    layoutInfoCodeBlock& info = m_code_block_info.at(m_curr_code_block);
-    copy_button->setGeometry(buttonX, y+(header_height/2.0)-(button_height/2.0), button_width, button_height);
+    QRect button_rect(buttonX, y+(header_height/2.0)-(button_height/2.0), button_width, button_height);
+    info.boundingBox = total_bounding_box;
+    info.button = button_rect;
+    addButton(button_rect, m_curr_code_block);
 
     y+=header_height+code_padding;
     x+=code_padding;
-    //render text
+    //one fragment for the text, the lines in view are drawn from the line index
     int right_border_x=max_x-x;
     int left_border_x=x;
-    m_code_block_info[m_curr_code_block].isOverflowing=false;
-    int max_line_width=0;
-    int curr_line_width=0;
-    for(const Element* child : segment.children) { // we know all children are spans of type code
-        QString line= std::get<span_data>(child->data).text;
-        QRect bounding(x,y,fm.horizontalAdvance(line),fm.height());
-        QRect clip(left_border_x-code_padding,y,right_border_x-left_border_x+2*code_padding,fm.height());
-        addClippedText(clip,bounding, line, m_curr_code_block);
-        x+=fm.horizontalAdvance(line);
-        curr_line_width+=fm.horizontalAdvance(line);
-        if(line=="\n" && child!=segment.children.back()){
-            y+=fm.lineSpacing();
-            x=left_border_x;
-            max_line_width=std::max(curr_line_width,max_line_width);
-            curr_line_width=0;
-        }
-
-    }
-
-    max_line_width = std::max(curr_line_width, max_line_width);
-    info.isOverflowing=max_line_width>total_bounding_box.width();
-    info.maxShift=std::min(-(max_line_width-total_bounding_box.width()+2*code_padding),0);
+    int line_breaks = (int)info.lines.size()-1;
+    QRect clip(left_border_x-code_padding,y,right_border_x-left_border_x+2*code_padding,line_breaks*fm.lineSpacing()+fm.height());
+    addCodeLines(clip, left_border_x, m_curr_code_block);
+    y+=line_breaks*fm.lineSpacing();
 
+    info.isOverflowing=info.max_line_width>total_bounding_box.width();
+    info.maxShift=std::min(-(info.max_line_width-total_bounding_box.width()+2*code_padding),0);
 
     //add space after code block
     y+=fm.lineSpacing();
@@ -1059,6 +1444,93 @@ void LatexLabel::renderCodeBlock(const Element& segment, qreal& x, qreal& y, qre
     m_curr_code_block++;
 }
 
+void LatexLabel::indexCodeLines(layoutInfoCodeBlock& info, const Element& segment, const QFontMetrics& metrics) {
+    //where the block's text lies in the source, its first and last lines are looked at, not all of them
+    std::span<const Element> children = m_tree.children(segment);
+    qsizetype source_begin = -1, source_end = -1;
+    for(const Element& child : children) {
+        const source_text& text = std::get<span_data>(child.data).text;
+        if(text.literal.isNull()) { source_begin = text.range.offset; break; }
+    }
+    for(auto child = children.rbegin(); child != children.rend(); ++child) {
+        const source_text& text = std::get<span_data>(child->data).text;
+        if(text.literal.isNull()) { source_end = text.range.offset + text.range.length; break; }
+    }
+    uint64_t generation = m_parse_generation.load();
+    bool same_document = info.measured && info.generation == generation && info.source_begin == source_begin;
+    if(same_document && info.source_end == source_end && info.child_count == children.size()) return; //laid out again, nothing to measure
+
+    //streamed into, the children up to the last line are the ones indexed before
+    bool grew = same_document && source_end >= info.source_end && children.size() >= info.child_count && !info.lines.empty();
+    size_t first = 0;
+    if(grew) {
+        first = info.child_count;
+        if(info.last_line_open) {
+            first = info.last_line_child;
+            info.lines.pop_back();
+        }
+    }
+    else {
+        info.lines.clear();
+        info.line_count = 1;
+        info.max_line_width = 0;
+    }
+    info.generation = generation;
+    info.source_begin = source_begin;
+    info.source_end = source_end;
+    info.child_count = static_cast<uint32_t>(children.size());
+
+    const SourceBuffer& source = m_parse_pending ? m_shown_source : m_source;
+    auto is_newline = [&](const source_text& text) {
+        if(!text.literal.isNull()) return text.literal == "\n";
+        return text.range.length == 1 && source.view(text.range)[0] == '\n';
+    };
+    //a line is one source range unless md4c made part of it up, then it is kept as a literal
+    source_text line;
+    bool line_empty = true;
+    size_t line_child = first;
+    auto close_line = [&]() {
+        info.max_line_width = std::max(info.max_line_width, metrics.horizontalAdvance(sourceText(line)));
+        info.lines.push_back(std::move(line));
+        line = source_text();
+        line_empty = true;
+    };
+    for(size_t i = first; i < children.size(); i++) {
+        const source_text& text = std::get<span_data>(children[i].data).text;
+        if(is_newline(text)) {
+            close_line();
+            info.line_count++;
+            line_child = i + 1;
+            continue;
+        }
+        if(line_empty) {
+            line = text;
+            line_empty = false;
+        }
+        else if(line.literal.isNull() && text.literal.isNull() && line.range.offset + line.range.length == text.range.offset) {
+            line.range.length += text.range.length;
+        }
+        else {
+            line.literal = sourceText(line) + sourceText(text);
+        }
+    }
+    //a line break closing the block doesn't start another line
+    info.last_line_open = !line_empty || info.lines.empty();
+    if(info.last_line_open) close_line();
+    info.last_line_child = static_cast<uint32_t>(line_child);
+    info.measured = true;
+}
+
+QString LatexLabel::codeBlockText(const layoutInfoCodeBlock& info) const {
+    QString text;
+    for(const source_text& line : info.lines) {
+        text += sourceText(line);
+        text += '\n';
+    }
+    if(info.last_line_open) text.chop(1);
+    return text;
+}
+
 void LatexLabel::renderBlockquote(const Element& segment, qreal& x, qreal& y, qreal min_x, qreal max_x, qreal& lineHeight) {
     // Add spacing before blockquote and move to next line if not at start
     y += lineHeight * 0.5; // Add spacing before blockquote
@@ -1072,13 +1544,13 @@ void LatexLabel::renderBlockquote(const Element& segment, qreal& x, qreal& y, qr
     qreal startX = x;
 
     // Render blockquote content
-    QFont blockquoteFont("Arial", m_textSize);
-    QFontMetricsF metrics(blockquoteFont);
-    for(const Element* child : segment.children) {
-        if(child->type==DisplayType::block) {
-            renderBlock(*child, x, y, min_x+50,max_x, lineHeight);
+    font_type blockquote_style = font_type::normal;
+    const QFontMetricsF& metrics = m_styles[blockquote_style].metrics_f;
+    for(const Element& child : m_tree.children(segment)) {
+        if(child.type==DisplayType::block) {
+            renderBlock(child, x, y, min_x+50,max_x, lineHeight);
         } else {
-            renderSpan(*child, x, y, min_x+50, max_x, lineHeight, &blockquoteFont);
+            renderSpan(child, x, y, min_x+50, max_x, lineHeight, &blockquote_style);
         }
     }
 
@@ -1116,28 +1588,27 @@ void LatexLabel::calculate_table_dimensions(const Element& segment, int* max_wid
         max_height_of_row[i] = 0;
     }
 
-    QFont base_font("Arial", m_textSize);
-    QFontMetrics base_metrics(base_font);
+    const QFontMetrics& base_metrics = m_styles[font_type::normal].metrics;
 
     int current_row = 0;
 
     //Process all children (TableHead and TableBody) to calculate row heights
-    for(const Element* table_section : segment.children) {
-        if(table_section->type != DisplayType::block) continue;
+    for(const Element& table_section : m_tree.children(segment)) {
+        if(table_section.type != DisplayType::block) continue;
 
-        MD_BLOCKTYPE section_type = BLOCKTYPE(table_section);
+        MD_BLOCKTYPE section_type = BLOCKTYPE(&table_section);
 
         //Process each row in this section
-        for(const Element* row : table_section->children) {
-            if(row->type != DisplayType::block || BLOCKTYPE(row) != MD_BLOCK_TR) continue;
+        for(const Element& row : m_tree.children(table_section)) {
+            if(row.type != DisplayType::block || BLOCKTYPE(&row) != MD_BLOCK_TR) continue;
 
             int current_col = 0;
             int row_max_height = 0;
 
             //Process each cell in this row
-            for(const Element* cell : row->children) {
-                if(cell->type != DisplayType::block) continue;
-                if(BLOCKTYPE(cell) != MD_BLOCK_TH && BLOCKTYPE(cell) != MD_BLOCK_TD) continue;
+            for(const Element& cell : m_tree.children(row)) {
+                if(cell.type != DisplayType::block) continue;
+                if(BLOCKTYPE(&cell) != MD_BLOCK_TH && BLOCKTYPE(&cell) != MD_BLOCK_TD) continue;
 
                 //Compute height by simulating wrapping across all spans in order
                 int available_width = max_width_of_col[current_col] + padding;
@@ -1147,20 +1618,18 @@ void LatexLabel::calculate_table_dimensions(const Element& segment, int* max_wid
                 int current_line_height = 0;
                 int cell_height = 0;
 
-                for(const Element* content : cell->children) {
-                    if(content->type != DisplayType::span) continue;
+                for(const Element& content : m_tree.children(cell)) {
+                    if(content.type != DisplayType::span) continue;
 
-                    spantype span_type = SPANTYPE(content);
+                    spantype span_type = SPANTYPE(&content);
 
                     if(span_type == spantype::latex) {
-                        latex_data latex_details = std::get<latex_data>(content->data);
-                        int latex_width = (int)latex_details.render->getWidth();
-                        int latex_height = (int)latex_details.render->getHeight();
+                        const latex_data& latex_details = std::get<latex_data>(content.data);
 
                         //Use base font for space width when advancing after inline latex
-                        QFont base_font("Arial", m_textSize);
-                        QFontMetrics base_metrics(base_font);
-                        int space_width = base_metrics.horizontalAdvance(" ");
+                        int space_width = m_styles[font_type::normal].space_advance;
+                        int latex_width, latex_height, latex_depth;
+                        latexExtent(latex_details, base_metrics, latex_width, latex_height, latex_depth);
 
                         if(current_x_sim + latex_width > available_width) {
                             cell_height += current_line_height > 0 ? current_line_height : base_metrics.lineSpacing();
@@ -1177,11 +1646,12 @@ void LatexLabel::calculate_table_dimensions(const Element& segment, int* max_wid
                        span_type == spantype::bold || span_type == spantype::italic ||
                        span_type == spantype::italic_bold || span_type == spantype::underline ||
                        span_type == spantype::hyperlink || span_type == spantype::strikethrough) {
-                        span_data text_data = std::get<span_data>(content->data);
+                        const span_data& text_data = std::get<span_data>(content.data);
 
-                        QFont font = getFont(content);
-                        QFontMetrics metrics(font);
-                        QStringList words = text_data.text.split(' ', Qt::SkipEmptyParts);
+                        font_type content_style_id = StyleTable::styleOf(content);
+                        const textStyle& content_style = m_styles[content_style_id];
+                        const QFontMetrics& metrics = content_style.metrics;
+                        QStringList words = sourceText(text_data.text).split(' ', Qt::SkipEmptyParts);
 
                         for(const QString& word : words) {
                             if(word == "\n") {
@@ -1191,8 +1661,8 @@ void LatexLabel::calculate_table_dimensions(const Element& segment, int* max_wid
                                 continue;
                             }
 
-                            int word_width = metrics.horizontalAdvance(word);
-                            int space_width = metrics.horizontalAdvance(" ");
+                            int word_width = m_styles.advance(content_style_id, word);
+                            int space_width = content_style.space_advance;
                             int total_width = word_width + space_width;
 
                             if(current_x_sim + total_width > available_width) {
@@ -1229,16 +1699,17 @@ void LatexLabel::calculate_table_dimensions(const Element& segment, int* max_wid
 
 void LatexLabel::renderTable(const Element& segment, qreal& x, qreal& y, qreal min_x, qreal max_x, qreal& lineHeight) {
     y+=10;
-    QFontMetrics fm(getFont(&segment));
-    bool header_only=segment.children.size()==1;
+    const QFontMetrics& fm = textStyleOf(&segment).metrics;
+    std::span<const Element> sections = m_tree.children(segment);
+    bool header_only=sections.size()==1;
 
-    Element* table_header_row=segment.children[0]->children[0];
-    Element* table_body = segment.children[1];
+    const Element* table_header_row=&m_tree.children(sections[0])[0];
+    const Element* table_body = header_only ? nullptr : &sections[1];
 
-    int columns=table_header_row->children.size();
+    int columns=table_header_row->child_count;
     int rows = 1;
     if(!header_only){
-        rows+=table_body->children.size();//table head + children of table body
+        rows+=table_body->child_count;//table head + children of table body
     }
 
     int max_width_of_col[columns];
@@ -1248,20 +1719,20 @@ void LatexLabel::renderTable(const Element& segment, qreal& x, qreal& y, qreal m
     //Calculate table dimensions
     calculate_table_dimensions(segment, max_width_of_col, max_height_of_row, columns, rows, min_x, max_x);
     //combine table header and table body into one list
-    std::vector<Element*> row_list;
-    if(header_only){
-        row_list.push_back(table_header_row);
-    }
-    else{
-        row_list=table_body->children;
-        row_list.insert(row_list.begin(),table_header_row);
+    std::vector<const Element*> row_list;
+    row_list.push_back(table_header_row);
+    if(!header_only){
+        for(const Element& row : m_tree.children(*table_body)){
+            row_list.push_back(&row);
+        }
     }
 
     //render table
     for(int i=0;i<row_list.size();i++){
-        Element* row = row_list[i];
-        for (int j=0;j<row->children.size();j++) {
-            Element* cell =row->children[j];
+        const Element* row = row_list[i];
+        std::span<const Element> cells = m_tree.children(*row);
+        for (int j=0;j<cells.size();j++) {
+            const Element* cell =&cells[j];
 
             addRoundedRect(x, y-fm.ascent()-padding, max_width_of_col[j]+2*padding, max_height_of_row[i]+2*padding, 0, QPalette::ColorRole::Window);
             int cell_start_x=x;
@@ -1269,9 +1740,9 @@ void LatexLabel::renderTable(const Element& segment, qreal& x, qreal& y, qreal m
             x+=padding;
 
 
-            for (Element* e : cell->children) {
-                if(e->type==DisplayType::span){
-                    renderSpan(*e, x, y, cell_start_x+padding, cell_start_x+max_width_of_col[j]+2*padding, lineHeight);
+            for (const Element& e : m_tree.children(*cell)) {
+                if(e.type==DisplayType::span){
+                    renderSpan(e, x, y, cell_start_x+padding, cell_start_x+max_width_of_col[j]+2*padding, lineHeight);
                 }
             }
             x=cell_start_x+max_width_of_col[j]+2*padding;
@@ -1291,33 +1762,138 @@ void LatexLabel::paintEvent(QPaintEvent* event){
     QStyleOption opt;
     opt.initFrom(this);
     style()->drawPrimitive(QStyle::PE_Widget, &opt, &painter, this);
-    painter.setRenderHint(QPainter::Antialiasing, true);
-    painter.setPen(Qt::black);
+    if(m_tile_caching){
+        paintTiles(painter, area);
+        return;
+    }
+    paintFragments(painter, area, paintContext());
+}
+
+paint_context LatexLabel::paintContext() const{
+    return paint_context{&m_styles, palette(), m_selected, m_selected >= 0 ? selectionRect() : QRect(), true, m_hovered_button, m_pressed_button};
+}
+
+void LatexLabel::paintTiles(QPainter& painter, const QRect& area){
+    qreal ratio = devicePixelRatioF();
+    m_tiles.setGeometry(width(), ratio);
+    int tile_height = m_tiles.tileHeight();
+    int first = m_tiles.tileAt(area.top());
+    int last = m_tiles.tileAt(area.bottom());
+    rasterizeTiles(first, last);
+    for(int tile = first; tile <= last; tile++) {
+        const QImage* image = m_tiles.find(tile);
+        if(!image) {
+            image = &m_tiles.insert(tile, renderTile(tile, width(), ratio, paintContext()));
+        }
+        //only the exposed part, in the image's device pixels
+        QRect tile_rect(0, tile * tile_height, width(), tile_height);
+        QRect part = tile_rect & area;
+        QRectF source(part.x() * ratio, (part.y() - tile_rect.y()) * ratio, part.width() * ratio, part.height() * ratio);
+        painter.drawImage(QRectF(part), *image, source);
+    }
+}
+
+void LatexLabel::rasterizeTiles(int first, int last){
+    int threads = m_tile_threads > 0 ? m_tile_threads : QThread::idealThreadCount();
+    if(threads < 2) return; //paintTiles renders them one by one
+
+    //a screen above and below too, scrolling finds them ready
+    QRect visible = viewportRect();
+    first = std::min(first, m_tiles.tileAt(visible.top() - visible.height()));
+    last = std::max(last, std::min(m_tiles.tileAt(visible.bottom() + visible.height()), m_tiles.tileAt(height() - 1)));
+    std::vector<int> missing;
+    for(int tile = first; tile <= last; tile++) {
+        if(!m_tiles.contains(tile)) missing.push_back(tile);
+    }
+    if(missing.size() < 2) return;
+
+    //workers only read the display list, the GUI thread waits for them
+    paint_context context = paintContext();
+    context.gui_thread = false;
+    int tile_width = width();
+    qreal ratio = devicePixelRatioF();
+    std::vector<QImage> images(missing.size());
+    m_tile_pool.setMaxThreadCount(threads - 1); //the calling thread is one of them
+    for(size_t i = 1; i < missing.size(); i++) {
+        m_tile_pool.start([&, i]() {
+            paint_context local = context;
+            local.styles = &worker_styles(m_style_generation, m_textSize, m_font_family, m_code_font_family);
+            images[i] = renderTile(missing[i], tile_width, ratio, local);
+        });
+    }
+    //the first one is ours instead of waiting idle, the text caches stay untouched while workers read them
+    images[0] = renderTile(missing[0], tile_width, ratio, context);
+    m_tile_pool.waitForDone();
+    for(size_t i = 0; i < missing.size(); i++) {
+        m_tiles.insert(missing[i], std::move(images[i]));
+    }
+}
 
+QImage LatexLabel::renderTile(int tile, int tile_width, qreal ratio, const paint_context& context){
+    int tile_height = m_tiles.tileHeight();
+    QImage image(QSize(tile_width, tile_height) * ratio, QImage::Format_ARGB32_Premultiplied);
+    image.setDevicePixelRatio(ratio);
+    image.fill(Qt::transparent); //the widget background is drawn under the tiles
+    QPainter painter(&image);
+    painter.translate(0, -tile * tile_height);
+    paintFragments(painter, QRect(0, tile * tile_height, tile_width, tile_height), context);
+    return image;
+}
 
+void LatexLabel::paintFragments(QPainter& painter, const QRect& area, const paint_context& context){
+    const StyleTable& styles = *context.styles;
+    const QPalette& palette = context.palette;
+    painter.setRenderHint(QPainter::Antialiasing, true);
+    painter.setPen(Qt::black);
 
-    for(Fragment& f: m_display_list){
-        if(!area.intersects(f.bounding_box)&&f.type!=fragment_type::clipped_text) continue;
+    //only the bands the exposed area covers, widened by what neighbours may draw into it
+    int overhang = paintOverhang();
+    QRect reach = area.adjusted(-overhang, -overhang, overhang, overhang);
+    std::vector<uint32_t> visible;
+    m_fragment_index.query(reach.top(), reach.bottom(), visible);
+    for(uint32_t index : visible){
+        Fragment& f = m_display_list[index];
+        if(!reach.intersects(f.bounding_box)) continue;
         if(f.is_highlighted){
             painter.save();
             painter.setPen(Qt::NoPen);
-            painter.setBrush(palette().highlight());
-            if(f.type==fragment_type::clipped_text){
-                int shift = m_code_block_info[((clipped_text_data*)f.data)->codeBlock_id].shift;
-                painter.drawRect(f.bounding_box.adjusted(shift, 0, shift, 0));
-            }
-            else{
-                painter.drawRect(f.bounding_box);
-            }
+            painter.setBrush(palette.highlight());
+            painter.drawRect((qsizetype)index==context.selected ? context.selection : f.bounding_box);
             painter.restore();
-            painter.setPen(palette().highlightedText().color());
+            painter.setPen(palette.highlightedText().color());
         }
         switch (f.type) {
             case fragment_type::latex:{
-                frag_latex_data* data = (frag_latex_data*) f.data;
+                const frag_latex_data* data = &m_display_list.latex(f);
                 painter.save();
-                painter.setBrush(palette().text());
+                if(data->stored) {
+                    //tinted mask from the disk cache, at the ratio it was stored with
+                    QImage image = FormulaImageCache::instance().image(data->stored, palette.text().color().rgba());
+                    int pad = FormulaImageCache::padding;
+                    painter.drawImage(QPoint(f.bounding_box.x() - pad, f.bounding_box.y() - pad), image);
+                    painter.restore();
+                    break;
+                }
+                if(!data->render){
+                    //placeholder while the formula is built
+                    painter.setPen(Qt::NoPen);
+                    painter.setBrush(palette.alternateBase());
+                    painter.drawRoundedRect(f.bounding_box, 3, 3);
+                    painter.restore();
+                    break;
+                }
+                if(painter.transform().type() <= QTransform::TxTranslate) {
+                    //blit the formula rasterized the first time it was painted
+                    QImage image = FormulaImageCache::instance().image(data->render, painter.device()->devicePixelRatioF(), palette.text().color().rgba());
+                    int pad = FormulaImageCache::padding;
+                    painter.drawImage(QPoint(f.bounding_box.x() - pad, f.bounding_box.y() - pad), image);
+                    painter.restore();
+                    break;
+                }
+                //scaled or rotated, an image would come out blurry
+                painter.setBrush(palette.text());
 
+                QMutexLocker lock(&microtexMutex()); //the worker may be building a formula meanwhile
                 tex::Graphics2D_qt g2(&painter);
                 data->render->draw(g2, f.bounding_box.x(), f.bounding_box.y());
                 painter.restore();
@@ -1325,18 +1901,18 @@ void LatexLabel::paintEvent(QPaintEvent* event){
             }
             case fragment_type::line:{
                 painter.save();
-                frag_line_data* data = (frag_line_data*) f.data;
-                painter.setPen(QPen(palette().mid(), data->width));
+                const frag_line_data* data = &m_display_list.line(f);
+                painter.setPen(QPen(palette.mid(), data->width));
 
                 painter.drawLine(QPoint(f.bounding_box.x(),f.bounding_box.y()),data->to);
                 painter.restore();
                 break;
             }
             case fragment_type::rounded_rect:{
-                frag_rrect_data* data = (frag_rrect_data*) f.data;
-                QBrush backgroundBrush = palette().brush(data->background);
+                const frag_rrect_data* data = &m_display_list.roundedRect(f);
+                QBrush backgroundBrush = palette.brush(data->background);
                 painter.setBrush(backgroundBrush);
-                painter.setPen(palette().brush(data->stroke).color());
+                painter.setPen(palette.brush(data->stroke).color());
 
                 // Create custom rounded rectangle with individual corner radii
                 QPainterPath path;
@@ -1366,156 +1942,347 @@ void LatexLabel::paintEvent(QPaintEvent* event){
                 break;
             }
             case fragment_type::text:{
-                frag_text_data* data = (frag_text_data*) f.data;
-                painter.setFont(data->font);
-                painter.setPen(palette().brush(data->color).color());
-                painter.drawText(f.bounding_box,data->text);
+                const frag_text_data* data = &m_display_list.text(f);
+                if(!context.gui_thread){
+                    //the glyph cache belongs to the GUI thread, QStaticText may lay itself out again while drawn
+                    painter.setFont(styles[data->style].font);
+                    painter.setPen(palette.brush(data->color).color());
+                    painter.drawText(QPointF(f.bounding_box.left(), f.bounding_box.top() + styles[data->style].ascent), m_display_list.chars(*data).toString());
+                    break;
+                }
+                if(!data->glyphs){
+                    //shaped once, Qt keeps the glyph positions for later paints
+                    data->glyphs.emplace(m_display_list.chars(*data).toString());
+                    data->glyphs->setTextFormat(Qt::PlainText);
+                    data->glyphs->prepare(painter.transform(), styles[data->style].font);
+                }
+                painter.setFont(styles[data->style].font);
+                painter.setPen(palette.brush(data->color).color());
+                painter.drawStaticText(f.bounding_box.topLeft(), *data->glyphs);
                 break;
             }
-            case fragment_type::clipped_text:{
-                int shift = m_code_block_info[((clipped_text_data*)f.data)->codeBlock_id].shift;
-                if(!area.intersects(f.bounding_box.adjusted(shift, 0, shift, 0))){
-                    continue;
+            case fragment_type::code_lines:{
+                const frag_code_data* data = &m_display_list.codeLines(f);
+                const layoutInfoCodeBlock& block = m_code_block_info[data->codeBlock_id];
+                const textStyle& mono = styles[font_type::mono];
+                int line_count = (int)block.lines.size();
+                //only the lines the exposed area covers
+                int first = std::max(0, (area.top() - f.bounding_box.top()) / mono.line_spacing);
+                int last = std::min(line_count - 1, (area.bottom() - f.bounding_box.top()) / mono.line_spacing);
+                painter.save();
+                painter.setPen(palette.text().color());
+                painter.setFont(mono.font);
+                painter.setClipRect(f.bounding_box);
+                for(int line = first; line <= last; line++) {
+                    QRect bounds(data->text_x + block.shift, f.bounding_box.top() + line * mono.line_spacing, 1000000, mono.line_spacing);
+                    painter.drawText(bounds, sourceText(block.lines[line]));
                 }
+                painter.restore();
+                break;
+            }
+            case fragment_type::button:{
+                int block_id = m_display_list.button(f).codeBlock_id;
                 painter.save();
-                painter.setPen(palette().text().color());
-                QFont font("Monaco");
-                font.setPointSize(m_textSize);
-                painter.setFont(font);
-
-                clipped_text_data* data = (clipped_text_data*) f.data;
-                auto block_id=data->codeBlock_id;
-
-                painter.setClipRect(data->clipArea);
-                painter.drawText(f.bounding_box.adjusted(m_code_block_info[block_id].shift, 0, 1000000, 1000000),data->text);
-
+                painter.setPen(Qt::NoPen);
+                if(block_id == context.pressed_button) painter.setBrush(palette.mid());
+                else if(block_id == context.hovered_button) painter.setBrush(palette.light());
+                else painter.setBrush(palette.button());
+                painter.drawRoundedRect(f.bounding_box, 5, 5);
+                painter.setPen(palette.buttonText().color());
+                painter.setFont(styles[font_type::normal].font);
+                painter.drawText(f.bounding_box, Qt::AlignCenter, "Copy");
                 painter.restore();
+                break;
             }
         }
         if(f.is_highlighted){
             painter.setPen(Qt::black);
         }
     }
-    /*
-    clock_t end = clock();
-    double elapsed = (double)(end - start) / CLOCKS_PER_SEC;
+}
 
-    //Update running average
-    total_time += elapsed;
-    iteration_count++;
+void LatexLabel::changeEvent(QEvent* event) {
+    if(event->type() == QEvent::ApplicationPaletteChange || event->type() == QEvent::PaletteChange || event->type() == QEvent::StyleChange) {
+        m_pallete = palette();
 
-    if(iteration_count >= max_iterations) {
-        double average_time = total_time / iteration_count;
-        qDebug() << QString("Average rendering time over %1 iterations: %2 ms")
-                    .arg(iteration_count)
-                    .arg(average_time * 1000, 0, 'f', 3);
+        //Renders are shared through the cache, so swap in ones built for the new color instead of recoloring
+        QRgb argb_color = palette().text().color().rgba();
+        refreshLatexRenders(argb_color);
+        FormulaImageCache::instance().purge();
+        relayout(width());
 
-        //Reset for next averaging period
-        total_time = 0.0;
-        iteration_count = 0;
+        update();
     }
+    QWidget::changeEvent(event);
+}
 
-     */
+void LatexLabel::refreshLatexRenders(QRgb argb_color) {
+    //the whole document is one array, no need to walk the tree
+    for(Element& element : m_tree.nodes()) {
+        if(element.type==DisplayType::span && SPANTYPE(&element)==spantype::latex) {
+            requestLatex(std::get<latex_data>(element.data), argb_color);
+        }
+    }
+}
 
+void LatexLabel::requestLatex(latex_data& data, QRgb argb_color) {
+    QElapsedTimer timer;
+    timer.start();
+    QString latex = sourceText(data.text);
+    //laid out and painted from an earlier run, no render needed
+    data.stored = FormulaDiskCache::instance().find(latex, data.isInline, m_textSize, devicePixelRatioF());
+    if(data.stored) {
+        data.render = nullptr;
+        data.pending = false;
+        m_timings.latex_ns += timer.nsecsElapsed();
+        return;
+    }
+    if(!m_async_latex) {
+        data.render = getLatexRenderer(latex, data.isInline, m_textSize, argb_color);
+        data.pending = false;
+        storeLatex(data);
+        m_timings.latex_ns += timer.nsecsElapsed();
+        return;
+    }
+    bool found = false;
+    data.render = LatexRenderCache::instance().lookup(latex, data.isInline, m_textSize, argb_color, &found);
+    data.pending = !found;
+    if(found) storeLatex(data);
+    m_timings.latex_ns += timer.nsecsElapsed();
+    if(!found) {
+        latex_cache_key key{latex, data.isInline, m_textSize, argb_color};
+        LatexRenderCache::instance().requestAsync(latex, data.isInline, m_textSize, argb_color, this, [this, key](std::shared_ptr<tex::TeXRender> render) {
+            //kept here, the cache may evict it before the refresh runs
+            m_finished_latex.insert(key, std::move(render));
+            scheduleLatexRefresh();
+        });
+    }
 }
 
-void LatexLabel::changeEvent(QEvent* event) {
-    if(event->type() == QEvent::ApplicationPaletteChange || event->type() == QEvent::PaletteChange || event->type() == QEvent::StyleChange) {
-        m_pallete = palette();
+bool LatexLabel::resolvePendingLatex(Element& element) {
+    if(element.type==DisplayType::span && SPANTYPE(&element)==spantype::latex) {
+        latex_data& data = std::get<latex_data>(element.data);
+        if(!data.pending) return false;
+        latex_cache_key key{sourceText(data.text), data.isInline, m_textSize, palette().text().color().rgba()};
+        std::shared_ptr<tex::TeXRender> render;
+        auto finished = m_finished_latex.constFind(key);
+        if(finished != m_finished_latex.constEnd()) {
+            render = finished.value();
+        }
+        else {
+            //another label's build of the same formula
+            bool found = false;
+            render = LatexRenderCache::instance().lookup(key.latex, key.isInline, key.text_size, key.color, &found);
+            if(!found) return false;
+        }
+        data.render = render;
+        data.pending = false;
+        storeLatex(data);
+        return true;
+    }
+    bool resolved = false;
+    for(Element& child : m_tree.children(element)) {
+        resolved |= resolvePendingLatex(child);
+    }
+    return resolved;
+}
 
-        //Update color for all latex fragments
-        QRgb argb_color = palette().text().color().rgba();
-        for(Fragment& f : m_display_list){
-            if(f.type != fragment_type::latex) continue;
-            frag_latex_data* data = (frag_latex_data*) f.data;
-            if(data && data->render){
-                //Update foreground color of the existing renderer
-                data->render->setForeground(static_cast<tex::color>(argb_color));
-            }
+void LatexLabel::scheduleLatexRefresh() {
+    //builds finish one after another, handle all that are done in one go
+    if(m_latex_refresh_scheduled) return;
+    m_latex_refresh_scheduled = true;
+    QTimer::singleShot(0, this, [this]() {
+        applyFinishedLatex();
+    });
+}
+
+void LatexLabel::applyFinishedLatex() {
+    m_latex_refresh_scheduled = false;
+    size_t first_changed = m_segments.size();
+    for(size_t i = 0; i < m_segments.size(); i++) {
+        if(resolvePendingLatex(m_tree[m_segments[i]]) && first_changed == m_segments.size()) {
+            first_changed = i;
         }
+    }
+    m_finished_latex.clear();
+    relayoutFrom(first_changed);
+}
 
-        update();
+void LatexLabel::storeLatex(const latex_data& data) {
+    if(data.render && FormulaDiskCache::instance().isOpen()) {
+        FormulaDiskCache::instance().insert(sourceText(data.text), data.isInline, m_textSize, devicePixelRatioF(), *data.render);
+    }
+}
+
+void LatexLabel::latexExtent(const latex_data& data, const QFontMetrics& metrics, int& width, int& height, int& depth) const {
+    if(data.stored) {
+        width = data.stored->width;
+        height = data.stored->height;
+        depth = data.stored->depth;
+        return;
+    }
+    if(data.render) {
+        width = data.render->getWidth();
+        height = data.render->getHeight();
+        depth = data.render->getDepth();
+        return;
+    }
+    //placeholder, roughly what the formula will take
+    int chars = std::min<int>(data.text.range.length + data.text.literal.size(), 60);
+    if(data.isInline) {
+        width = std::max(metrics.averageCharWidth() * chars / 2, metrics.height());
+        height = metrics.height();
+        depth = metrics.descent();
+    }
+    else {
+        width = metrics.averageCharWidth() * chars / 2;
+        height = 2 * metrics.height();
+        depth = metrics.descent();
     }
-    QWidget::changeEvent(event);
 }
 
 void LatexLabel::resizeEvent(QResizeEvent* event) {
 
     QWidget::resizeEvent(event);
 
-    if(!m_text.isEmpty() && event->oldSize().width() != event->size().width()) {
-        deleteDisplayList();
-        parseMarkdown(m_text);//this is expensive, need to find way to avoid without dangling latex pointers in m_segments
+    if(!m_source.isEmpty() && event->oldSize().width() != event->size().width()) {
+        relayout(event->size().width()); //renders are shared between AST and fragments, no need to parse again
         update();
     }
 }
 
 
+void LatexLabel::moveEvent(QMoveEvent* event) {
+    QWidget::moveEvent(event);
+    realizeViewport(false);
+}
+
+bool LatexLabel::eventFilter(QObject* watched, QEvent* event) {
+    if(watched == m_watched_viewport && event->type() == QEvent::Resize) {
+        realizeViewport(false);
+    }
+    return QWidget::eventFilter(watched, event);
+}
+
 void LatexLabel::appendText(QString& text){
-    if(text.isEmpty()) return;
-    m_text += text;
+    appendUtf8(text.toUtf8()); //only the new text is converted
+}
 
-    //clock_t start = clock();
-    deleteDisplayList();
-    parseMarkdown(m_text);
-    /*
-    clock_t end = clock();
-    double elapsed = (double)(end - start) / CLOCKS_PER_SEC;
+void LatexLabel::appendUtf8(QByteArrayView utf8){
+    if(utf8.isEmpty()) return;
+    m_source.append(utf8);
+    if(m_queued_chunks > 0) {
+        flushQueuedText(); //the queued chunks are parsed along with it and counted as their flush
+        return;
+    }
+    if(m_parse_pending) return; //the snapshot is a prefix of m_source, its swap parses the rest
 
-    qDebug() << "Parsing took: " << elapsed*1000 << "ms";
-    */
+    parseTail(); //only the blocks after the frozen prefix can change
     update();
     adjustSize();
 }
-void LatexLabel::deleteDisplayList(){
-    for (Fragment& f : m_display_list) {
-        switch (f.type) {
-            case fragment_type::latex:{
-                frag_latex_data* data = (frag_latex_data*) f.data;
-                delete data->render;
-                delete data;
-                break;
-            }
-            case fragment_type::line:{
-                frag_line_data* data = (frag_line_data*) f.data;
-                delete data;
-                break;
-            }
-            case fragment_type::rounded_rect:{
-                frag_rrect_data* data = (frag_rrect_data*) f.data;
-                delete data;
-                break;
-            }
-            case fragment_type::text:{
-                frag_text_data* data = (frag_text_data*) f.data;
-                delete data;
-                break;
-            }
-            case fragment_type::clipped_text:{
-                clipped_text_data* data = (clipped_text_data*) f.data;
-                delete data;
-                break;
-            }
-        }
+void LatexLabel::queueText(const QString& text){
+    queueUtf8(text.toUtf8());
+}
+
+void LatexLabel::queueUtf8(QByteArrayView utf8){
+    if(utf8.isEmpty()) return;
+    m_source.append(utf8);
+    m_queued_chunks++;
+    m_append_stats.chunks++;
+    m_append_stats.bytes += utf8.size();
+    if(m_append_flush_scheduled) return;
+    //the first chunk of an interval schedules the parse, the ones after it wait for it
+    m_append_flush_scheduled = true;
+    QTimer::singleShot(m_append_interval, this, [this]() {
+        m_append_flush_scheduled = false;
+        flushQueuedText();
+    });
+}
+
+void LatexLabel::flushQueuedText(){
+    if(m_queued_chunks == 0) return;
+    m_append_stats.flushes++;
+    m_append_stats.merged += m_queued_chunks - 1;
+    m_queued_chunks = 0;
+    if(m_parse_pending) return; //the snapshot's swap parses the queued text too
 
+    parseTail();
+    update();
+    adjustSize();
+}
+
+void LatexLabel::setAppendInterval(int msecs){
+    m_append_interval = std::max(0, msecs);
+}
+
+int LatexLabel::appendInterval() const{
+    return m_append_interval;
+}
+
+append_queue_stats LatexLabel::appendQueueStats() const{
+    return m_append_stats;
+}
+
+void LatexLabel::resetAppendQueueStats(){
+    m_append_stats = append_queue_stats();
+}
+
+void LatexLabel::deleteDisplayList(size_t from){
+    if(from >= m_display_list.size()) return;
+    if(m_tile_caching) {
+        QRect dropped;
+        for(size_t i = from; i < m_display_list.size(); i++) {
+            dropped |= m_display_list[i].bounding_box;
+        }
+        invalidateTiles(dropped);
+    }
+    m_fragment_index.truncate(from);
+    if(m_selected >= (qsizetype)from){
+        m_selected=-1;
     }
-    m_display_list.clear();
+    m_display_list.truncate(from);
 }
 
-void LatexLabel::setText(QString text){
-    m_raw_text.clear();
+void LatexLabel::resetDocumentState(){
     m_code_block_info.clear();
-    deleteDisplayList();
-    m_display_list.clear();
-    m_text = text;
-    clock_t start = clock();
-    parseMarkdown(m_text);
-    clock_t end = clock();
-    double elapsed = (double)(end - start) / CLOCKS_PER_SEC;
+    m_hovered_button = -1;
+    m_pressed_button = -1;
+}
+
+QString LatexLabel::sourceText(const source_text& text) const {
+    if(!text.literal.isNull()) return text.literal;
+    return (m_parse_pending ? m_shown_source : m_source).text(text.range);
+}
 
-    qDebug() << "Parsing took: " << elapsed*1000 << "ms";
+void LatexLabel::setText(QString text){
+    SourceBuffer source;
+    source.assign(text.toUtf8());
+    setSource(std::move(source));
+}
 
+bool LatexLabel::setFile(const QString& path){
+    SourceBuffer source;
+    if(!source.mapFile(path)) return false; //the current document stays
+    setSource(std::move(source));
+    return true;
+}
 
+void LatexLabel::setSource(SourceBuffer source){
+    m_parse_generation++; //a background parse of the previous text is superseded
+    m_queued_chunks = 0; //went with the old source
+    if(m_background_parsing && source.size() >= m_background_parse_threshold) {
+        //the previous document stays on screen until the snapshot is swapped in
+        if(!m_parse_pending) m_shown_source = std::move(m_source);
+        m_source = std::move(source);
+        startBackgroundParse();
+        return;
+    }
+    m_source = std::move(source);
+    m_parse_pending = false;
+    m_shown_source.clear();
+    resetDocumentState();
+    parseMarkdown(); //timings() has the cost of each phase
 
     update();
     adjustSize();
@@ -1523,18 +2290,23 @@ void LatexLabel::setText(QString text){
 
 
 void LatexLabel::printSegmentsStructure() const {
-    qDebug() << "=== m_segments Structure ===";
+    qDebug().noquote() << segmentsStructure();
+}
+
+QString LatexLabel::segmentsStructure() const {
+    QString out = "=== m_segments Structure ===\n";
     for(size_t i = 0; i < m_segments.size(); i++) {
-        qDebug() << QString("m_segments[%1]:").arg(i);
-        printSegmentRecursive(m_segments[i], 0);
+        out += QString("m_segments[%1]:\n").arg(i);
+        appendSegmentStructure(out, &m_tree[m_segments[i]], 0);
     }
-    qDebug() << "=== End Structure ===";
+    out += "=== End Structure ===";
+    return out;
 }
 
-void LatexLabel::printSegmentRecursive(const Element* element, int depth) const {
+void LatexLabel::appendSegmentStructure(QString& out, const Element* element, int depth) const {
     if(!element) {
         QString indent = QString("  ").repeated(depth);
-        qDebug().noquote() << QString("%1null element").arg(indent);
+        out += QString("%1null element\n").arg(indent);
         return;
     }
 
@@ -1550,8 +2322,8 @@ void LatexLabel::printSegmentRecursive(const Element* element, int depth) const
             break;
     }
 
-    qDebug().noquote() << QString("%1Element {").arg(indent);
-    qDebug().noquote() << QString("%1  type: %2").arg(indent, typeStr);
+    out += QString("%1Element {\n").arg(indent);
+    out += QString("%1  type: %2\n").arg(indent, typeStr);
 
     if(element->type == DisplayType::block) {
         QString blockTypeStr;
@@ -1574,38 +2346,38 @@ void LatexLabel::printSegmentRecursive(const Element* element, int depth) const
             case MD_BLOCK_TH: blockTypeStr = "TableHeader"; break;
             case MD_BLOCK_TD: blockTypeStr = "TableData"; break;
         }
-        qDebug().noquote() << QString("%1  blockType: %2").arg(indent, blockTypeStr);
+        out += QString("%1  blockType: %2\n").arg(indent, blockTypeStr);
 
         if(blockType == MD_BLOCK_LI) {
             list_item_data data = std::get<list_item_data>(element->data);
-            qDebug().noquote() << QString("%1  listItemData: {").arg(indent);
-            qDebug().noquote() << QString("%1    isOrdered: %2").arg(indent).arg(data.is_ordered ? "true" : "false");
-            qDebug().noquote() << QString("%1    itemIndex: %2").arg(indent).arg(data.item_index);
-            qDebug().noquote() << QString("%1  }").arg(indent);
+            out += QString("%1  listItemData: {\n").arg(indent);
+            out += QString("%1    isOrdered: %2\n").arg(indent).arg(data.is_ordered ? "true" : "false");
+            out += QString("%1    itemIndex: %2\n").arg(indent).arg(data.item_index);
+            out += QString("%1  }\n").arg(indent);
         }
 
         if(blockType == MD_BLOCK_H) {
             heading_data data = std::get<heading_data>(element->data);
-            qDebug().noquote() << QString("%1  headingData: {").arg(indent);
-            qDebug().noquote() << QString("%1    level: %2").arg(indent).arg(data.level);
-            qDebug().noquote() << QString("%1  }").arg(indent);
+            out += QString("%1  headingData: {\n").arg(indent);
+            out += QString("%1    level: %2\n").arg(indent).arg(data.level);
+            out += QString("%1  }\n").arg(indent);
         }
 
         if((blockType == MD_BLOCK_UL || blockType == MD_BLOCK_OL)) {
             list_data data = std::get<list_data>(element->data);
-            qDebug().noquote() << QString("%1  listData: {").arg(indent);
-            qDebug().noquote() << QString("%1    isOrdered: %2").arg(indent).arg(data.is_ordered ? "true" : "false");
+            out += QString("%1  listData: {\n").arg(indent);
+            out += QString("%1    isOrdered: %2\n").arg(indent).arg(data.is_ordered ? "true" : "false");
             if(data.is_ordered) {
-                qDebug().noquote() << QString("%1    startIndex: %2").arg(indent).arg(data.start_index);
+                out += QString("%1    startIndex: %2\n").arg(indent).arg(data.start_index);
             }
-            qDebug().noquote() << QString("%1  }").arg(indent);
+            out += QString("%1  }\n").arg(indent);
         }
 
         if(blockType == MD_BLOCK_CODE) {
             code_block_data data = std::get<code_block_data>(element->data);
-            qDebug().noquote() << QString("%1  codeBlockData: {").arg(indent);
-            qDebug().noquote() << QString("%1    language: \"%2\"").arg(indent, data.language);
-            qDebug().noquote() << QString("%1  }").arg(indent);
+            out += QString("%1  codeBlockData: {\n").arg(indent);
+            out += QString("%1    language: \"%2\"\n").arg(indent, sourceText(data.language));
+            out += QString("%1  }\n").arg(indent);
         }
     }
 
@@ -1625,113 +2397,141 @@ void LatexLabel::printSegmentRecursive(const Element* element, int depth) const
             case spantype::linebreak: spanTypeStr = "LineBreak"; break;
             case spantype::italic_bold: spanTypeStr = "Italic & Bold"; break;
         }
-        qDebug().noquote() << QString("%1  spanType: %2").arg(indent, spanTypeStr);
+        out += QString("%1  spanType: %2\n").arg(indent, spanTypeStr);
 
         if(sType == spantype::hyperlink) {
             link_data data = std::get<link_data>(element->data);
-            qDebug().noquote() << QString("%1  linkData: {").arg(indent);
-            qDebug().noquote() << QString("%1    url: \"%2\"").arg(indent, data.url);
-            qDebug().noquote() << QString("%1    title: \"%2\"").arg(indent, data.title);
-            qDebug().noquote() << QString("%1  }").arg(indent);
+            out += QString("%1  linkData: {\n").arg(indent);
+            out += QString("%1    url: \"%2\"\n").arg(indent, sourceText(data.url));
+            out += QString("%1    title: \"%2\"\n").arg(indent, sourceText(data.title));
+            out += QString("%1  }\n").arg(indent);
         }
 
         if(sType == spantype::latex) {
             latex_data data = std::get<latex_data>(element->data);
-            qDebug().noquote() << QString("%1  latexData: {").arg(indent);
-            qDebug().noquote() << QString("%1    isInline: %2").arg(indent).arg(data.isInline ? "true" : "false");
+            out += QString("%1  latexData: {\n").arg(indent);
+            out += QString("%1    isInline: %2\n").arg(indent).arg(data.isInline ? "true" : "false");
             if(data.render) {
-                qDebug().noquote() << QString("%1    render: (width: %2, height: %3)")
+                out += QString("%1    render: (width: %2, height: %3)\n")
                     .arg(indent)
                     .arg(data.render->getWidth())
                     .arg(data.render->getHeight());
             } else {
-                qDebug().noquote() << QString("%1    render: null").arg(indent);
+                out += QString("%1    render: null\n").arg(indent);
             }
-            qDebug().noquote() << QString("%1  }").arg(indent);
+            out += QString("%1  }\n").arg(indent);
         }
 
         if((sType == spantype::normal || sType == spantype::code)) {
             span_data data = std::get<span_data>(element->data);
-            QString contentStr = data.text;
+            QString contentStr = sourceText(data.text);
             if(contentStr.length() > 50) {
                 contentStr = contentStr.left(47) + "...";
             }
-            contentStr = contentStr.replace('\n', "\\n").replace('\t', "\\t");
-            qDebug().noquote() << QString("%1  text: \"%2\"").arg(indent, contentStr);
+            contentStr = contentStr.replace('\n', "\n").replace('\t', "\\t");
+            out += QString("%1  text: \"%2\"\n").arg(indent, contentStr);
         }
     }
 
-    if(!element->children.empty()) {
-        qDebug().noquote() << QString("%1  children: [").arg(indent);
-        for(size_t i = 0; i < element->children.size(); i++) {
-            if(i > 0) qDebug().noquote() << QString("%1    ,").arg(indent);
-            printSegmentRecursive(element->children[i], depth + 2);
+    if(element->child_count > 0) {
+        out += QString("%1  children: [\n").arg(indent);
+        std::span<const Element> children = m_tree.children(*element);
+        for(size_t i = 0; i < children.size(); i++) {
+            if(i > 0) out += QString("%1    ,\n").arg(indent);
+            appendSegmentStructure(out, &children[i], depth + 2);
         }
-        qDebug().noquote() << QString("%1  ]").arg(indent);
+        out += QString("%1  ]\n").arg(indent);
     }
 
-    qDebug().noquote() << QString("%1}").arg(indent);
+    out += QString("%1}\n").arg(indent);
 }
 
 void LatexLabel::mousePressEvent(QMouseEvent* event) {
-    if(m_selected){
+    int button = codeBlockButtonAt(event->pos());
+    if(button >= 0 && event->button() == Qt::LeftButton){
+        //like a real button, the click doesn't reach the text under it
+        m_pressed_button = button;
+        invalidateArea(m_code_block_info[button].button);
+        return;
+    }
+    if(m_selected>=0){
         //remove selection
-        m_selected->is_highlighted=false;
-        QRect selected_bb;
-        if(m_selected->type==fragment_type::clipped_text){
-            int shift = m_code_block_info[((clipped_text_data*)m_selected->data)->codeBlock_id].shift;
-            selected_bb=m_selected->bounding_box.adjusted(shift, 0, shift, 0);
-        }
-        else{
-            selected_bb=m_selected->bounding_box;
-        }
-        m_selected=nullptr;
-        update(selected_bb);
+        m_display_list[m_selected].is_highlighted=false;
+        QRect selected_bb = selectionRect();
+        m_selected=-1;
+        invalidateArea(selected_bb);
     }
 
 }
 void LatexLabel::mouseMoveEvent(QMouseEvent* event) {
-
+    setHoveredButton(codeBlockButtonAt(event->pos()));
 }
 void LatexLabel::mouseReleaseEvent(QMouseEvent* event) {
+    if(m_pressed_button < 0 || event->button() != Qt::LeftButton) return;
+    int pressed = m_pressed_button;
+    m_pressed_button = -1;
+    if(pressed >= (int)m_code_block_info.size()) return; //the text was replaced while the button was held
+    invalidateArea(m_code_block_info[pressed].button);
+    //only counts when released over the button that was pressed
+    if(codeBlockButtonAt(event->pos()) == pressed){
+        QGuiApplication::clipboard()->setText(codeBlockText(m_code_block_info[pressed])); //built only when copied
+    }
+}
+void LatexLabel::leaveEvent(QEvent* event) {
+    setHoveredButton(-1);
+    QWidget::leaveEvent(event);
+}
+int LatexLabel::codeBlockButtonAt(const QPoint& pos) const{
+    for(uint32_t index : m_fragment_index.band(pos.y())){
+        const Fragment& f = m_display_list[index];
+        if(f.type==fragment_type::button && f.bounding_box.contains(pos)){
+            return m_display_list.button(f).codeBlock_id;
+        }
+    }
+    return -1;
+}
+void LatexLabel::setHoveredButton(int codeBlock_id){
+    if(codeBlock_id == m_hovered_button) return;
+    if(m_hovered_button >= 0 && m_hovered_button < (int)m_code_block_info.size()){
+        invalidateArea(m_code_block_info[m_hovered_button].button);
+    }
+    m_hovered_button = codeBlock_id;
+    if(codeBlock_id >= 0){
+        invalidateArea(m_code_block_info[codeBlock_id].button);
+        setCursor(QCursor(Qt::PointingHandCursor));
+    }
+    else{
+        unsetCursor();
+    }
 }
 void LatexLabel::mouseDoubleClickEvent(QMouseEvent* event){
-    for(Fragment& f :m_display_list){
-        switch(f.type){
-            case fragment_type::clipped_text:{
-                int shift = m_code_block_info[((clipped_text_data*)f.data)->codeBlock_id].shift;
-                if(f.bounding_box.adjusted(shift, 0, shift, 0).contains(event->pos())){
-                    f.is_highlighted=true;
-                    m_selected=&f;
-                    update(f.bounding_box.adjusted(shift, 0, shift, 0));
-                }
-                break;
-            }
-            case fragment_type::line:
-            case fragment_type::rounded_rect:
-                continue;
-            default:
-                if(!f.bounding_box.contains(event->pos()))
-                    continue;
-                f.is_highlighted=true;
-                m_selected=&f;
-                update(f.bounding_box);
-                break;
+    //the band of the click has every candidate, code is scrolled inside its own box
+    for(uint32_t index : m_fragment_index.band(event->pos().y())){
+        Fragment& f = m_display_list[index];
+        if(f.type==fragment_type::line || f.type==fragment_type::rounded_rect || f.type==fragment_type::button || f.type==fragment_type::code_lines) continue;
+        if(!f.bounding_box.contains(event->pos())) continue;
+        if(m_selected>=0){
+            m_display_list[m_selected].is_highlighted=false;
+            invalidateArea(selectionRect());
         }
-
+        f.is_highlighted=true;
+        m_selected=index;
+        selectWordAt(event->pos().x());
+        invalidateArea(selectionRect());
     }
 
     // Make sure the widget gets focus when clicked
     setFocus();
 }
 void LatexLabel::keyPressEvent(QKeyEvent* event){
-    if(event->matches(QKeySequence::Copy)&&m_selected){
+    if(event->matches(QKeySequence::Copy)&&m_selected>=0){
         QString selected_text="error: can't copy this element";
-        if(m_selected->type==fragment_type::latex){
-            selected_text=((latex_data*)m_selected->data)->text;
+        const Fragment& selected = m_display_list[m_selected];
+        if(selected.type==fragment_type::latex){
+            selected_text=m_display_list.latex(selected).text;
         }
-        else if(m_selected->type==fragment_type::text){
-            selected_text=((frag_text_data*) m_selected->data)->text;
+        else if(selected.type==fragment_type::text){
+            selected_text=m_display_list.chars(m_display_list.text(selected)).mid(m_selected_offset, m_selected_length).toString();
         }
         QGuiApplication::clipboard()->setText(selected_text);
     }
@@ -1741,27 +2541,94 @@ void LatexLabel::keyPressEvent(QKeyEvent* event){
 }
 
 // Fragment creation helper methods for better readability
-void LatexLabel::addText(qreal x, qreal y, qreal width, qreal height, const QString& text, const QFont& font, QPalette::ColorRole color) {
-    m_display_list.push_back(Fragment(QRect(x, y, width, height), text, font, color));
+void LatexLabel::addText(qreal x, qreal y, qreal width, qreal height, const QString& text, font_type style, QPalette::ColorRole color) {
+    m_display_list.addText(QRect(x, y, width, height), text, style, color);
+    indexLastFragment();
 }
 
-void LatexLabel::addLatex(qreal x, qreal y, qreal width, qreal height, tex::TeXRender* render, const QString& text, bool isInline) {
-    m_display_list.push_back(Fragment(QRect(x, y, width, height), render, text, isInline));
+void LatexLabel::addLatex(qreal x, qreal y, qreal width, qreal height, std::shared_ptr<tex::TeXRender> render, const QString& text, bool isInline, std::shared_ptr<const stored_formula> stored) {
+    m_display_list.addLatex(QRect(x, y, width, height), render, text, isInline, std::move(stored));
+    indexLastFragment();
 }
 
 void LatexLabel::addLine(qreal x, qreal y, qreal width, qreal height, const QPoint& to, int lineWidth) {
-    m_display_list.push_back(Fragment(QRect(x, y, width, height), to, lineWidth));
+    m_display_list.addLine(QRect(x, y, width, height), to, lineWidth);
+    indexLastFragment();
 }
 
 void LatexLabel::addRoundedRect(qreal x, qreal y, qreal width, qreal height, qreal radius, QPalette::ColorRole bg, QPalette::ColorRole stroke) {
     QRect r(x,y,width,height);
-    m_display_list.push_back(Fragment(QRect(x, y, width, height), r, radius, bg, stroke));
+    m_display_list.addRoundedRect(r, frag_rrect_data(r, radius, bg, stroke));
+    indexLastFragment();
 }
 
 void LatexLabel::addRoundedRect(qreal x, qreal y, qreal width, qreal height, qreal tl, qreal tr, qreal bl, qreal br, QPalette::ColorRole bg, QPalette::ColorRole stroke) {
     QRect r(x,y,width,height);
-    m_display_list.push_back(Fragment(QRect(x, y, width, height), r, tl, tr, bl, br, bg, stroke));
+    m_display_list.addRoundedRect(r, frag_rrect_data(r, tl, tr, bl, br, bg, stroke));
+    indexLastFragment();
 }
-void LatexLabel::addClippedText(QRect clip, QRect bounding, QString& text,int id){
-    m_display_list.push_back(Fragment(clip,bounding,text,id));
+void LatexLabel::addCodeLines(const QRect& clip, int text_x, int codeBlock_id){
+    m_display_list.addCodeLines(clip, text_x, codeBlock_id);
+    indexLastFragment();
 }
+void LatexLabel::addButton(const QRect& rect, int codeBlock_id){
+    m_display_list.addButton(rect, codeBlock_id);
+    indexLastFragment();
+}
+void LatexLabel::indexLastFragment(){
+    const QRect& bounding_box = m_display_list.back().bounding_box;
+    m_fragment_index.insert(m_display_list.size()-1, bounding_box);
+    invalidateTiles(bounding_box);
+}
+
+void LatexLabel::invalidateArea(const QRect& rect){
+    invalidateTiles(rect);
+    int overhang = paintOverhang();
+    update(rect.adjusted(-overhang, -overhang, overhang, overhang));
+}
+void LatexLabel::invalidateTiles(const QRect& bounding_box){
+    if(!m_tile_caching || bounding_box.isNull()) return;
+    int overhang = paintOverhang();
+    m_tiles.invalidate(bounding_box.top() - overhang, bounding_box.bottom() + overhang);
+}
+int LatexLabel::paintOverhang() const{
+    //formula images are padded for antialiasing, italic and accented glyphs reach past their advance
+    return FormulaImageCache::padding + m_textSize / 4 + 1;
+}
+void LatexLabel::selectWordAt(int x){
+    //text fragments hold a whole run of words, pick the one under x
+    const Fragment& f = m_display_list[m_selected];
+    m_selected_offset = 0;
+    m_selected_length = -1;
+    if(f.type!=fragment_type::text) return;
+    const frag_text_data& data = m_display_list.text(f);
+    QString run = m_display_list.chars(data).toString();
+    const QFontMetrics& metrics = m_styles[data.style].metrics;
+    qsizetype start = 0;
+    while(start < run.size()){
+        qsizetype end = run.indexOf(' ', start);
+        if(end == -1) end = run.size();
+        int right = f.bounding_box.x() + metrics.horizontalAdvance(run, end);
+        if(x < right + metrics.horizontalAdvance(' ') || end == run.size()){
+            m_selected_offset = start;
+            m_selected_length = end - start;
+            return;
+        }
+        start = end + 1;
+    }
+}
+
+QRect LatexLabel::selectionRect() const{
+    const Fragment& f = m_display_list[m_selected];
+    if(f.type!=fragment_type::text || m_selected_length < 0){
+        return f.bounding_box;
+    }
+    const frag_text_data& data = m_display_list.text(f);
+    QString run = m_display_list.chars(data).toString();
+    const QFontMetrics& metrics = m_styles[data.style].metrics;
+    int left = metrics.horizontalAdvance(run, m_selected_offset);
+    int width = metrics.horizontalAdvance(run.mid(m_selected_offset, m_selected_length));
+    return QRect(f.bounding_box.x() + left, f.bounding_box.y(), width + 1, f.bounding_box.height());
+}
+
+
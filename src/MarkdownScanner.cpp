@@ -0,0 +1,203 @@
+#include "MarkdownScanner.h"
+
+static bool is_blank(QByteArrayView line){
+    for(char c : line){
+        if(c != ' ' && c != '\t' && c != '\r') return false;
+    }
+    return true;
+}
+
+static int leading_spaces(QByteArrayView line){
+    int n = 0;
+    for(char c : line){
+        if(c == ' ') n++;
+        else if(c == '\t') n += 4;
+        else break;
+    }
+    return n;
+}
+
+// counts the run of fence characters at the start of line, 0 if it is no fence
+static int fence_length(QByteArrayView line, char& fence_char){
+    qsizetype i = 0;
+    while(i < line.size() && i < 3 && line[i] == ' ') i++;
+    if(i >= line.size() || (line[i] != '`' && line[i] != '~')) return 0;
+    char c = line[i];
+    int n = 0;
+    while(i < line.size() && line[i] == c){
+        n++;
+        i++;
+    }
+    if(n < 3) return 0;
+    if(c == '`' && line.mid(i).indexOf('`') != -1) return 0; //backtick fences can't have backticks in the info string
+    fence_char = c;
+    return n;
+}
+
+static bool closes_fence(QByteArrayView line, char fence_char, int open_length){
+    char c = 0;
+    int n = fence_length(line, c);
+    if(n < open_length || c != fence_char) return false;
+    qsizetype i = line.indexOf(fence_char) + n;
+    return is_blank(line.mid(i));
+}
+
+static bool is_list_marker(QByteArrayView line){
+    qsizetype i = 0;
+    while(i < line.size() && i < 3 && line[i] == ' ') i++;
+    if(i >= line.size()) return false;
+    char c = line[i];
+    if(c == '-' || c == '+' || c == '*'){
+        i++;
+    }
+    else{
+        qsizetype digits = 0;
+        while(i < line.size() && line[i] >= '0' && line[i] <= '9' && digits < 9){
+            i++;
+            digits++;
+        }
+        if(digits == 0 || i >= line.size() || (line[i] != '.' && line[i] != ')')) return false;
+        i++;
+    }
+    return i == line.size() || line[i] == ' ' || line[i] == '\t' || line[i] == '\r';
+}
+
+static bool is_reference_definition(QByteArrayView line){
+    qsizetype i = 0;
+    while(i < line.size() && line[i] == ' ') i++;
+    if(i > 3 || i >= line.size() || line[i] != '[') return false;
+    qsizetype close = line.indexOf(']', i + 1);
+    return close > i + 1 && close + 1 < line.size() && line[close + 1] == ':';
+}
+
+static char ascii_lower(char c){
+    return (c >= 'A' && c <= 'Z') ? char(c - 'A' + 'a') : c;
+}
+
+static bool starts_with_nocase(QByteArrayView text, QByteArrayView lower_prefix){
+    if(text.size() < lower_prefix.size()) return false;
+    for(qsizetype i = 0; i < lower_prefix.size(); i++){
+        if(ascii_lower(text[i]) != lower_prefix[i]) return false;
+    }
+    return true;
+}
+
+// CommonMark HTML blocks of types 1-5 run until an end marker, blank lines included
+enum class html_block{ none, raw, comment, instruction, declaration, cdata };
+
+static const QByteArrayView raw_tags[] = {"script", "pre", "style", "textarea"};
+
+// the kind of html block line opens, tag is set to the raw tag for html_block::raw
+static html_block html_block_start(QByteArrayView line, QByteArrayView& tag){
+    qsizetype i = 0;
+    while(i < line.size() && i < 3 && line[i] == ' ') i++;
+    QByteArrayView rest = line.mid(i);
+    if(rest.size() < 2 || rest[0] != '<') return html_block::none;
+    if(rest.startsWith("<!--")) return html_block::comment;
+    if(rest.startsWith("<?")) return html_block::instruction;
+    if(rest.startsWith("<![CDATA[")) return html_block::cdata;
+    if(rest[1] == '!' && rest.size() > 2 && ascii_lower(rest[2]) >= 'a' && ascii_lower(rest[2]) <= 'z') return html_block::declaration;
+    for(QByteArrayView name : raw_tags){
+        if(!starts_with_nocase(rest.mid(1), name)) continue;
+        qsizetype after = 1 + name.size();
+        if(after == rest.size() || rest[after] == ' ' || rest[after] == '\t' || rest[after] == '>' || rest[after] == '\r'){
+            tag = name;
+            return html_block::raw;
+        }
+    }
+    return html_block::none;
+}
+
+static bool closes_html_block(QByteArrayView line, html_block kind, QByteArrayView tag){
+    switch(kind){
+    case html_block::raw:
+        for(qsizetype i = 0; i + 2 + tag.size() < line.size(); i++){
+            if(line[i] == '<' && line[i + 1] == '/' && starts_with_nocase(line.mid(i + 2), tag) && line[i + 2 + tag.size()] == '>') return true;
+        }
+        return false;
+    case html_block::comment: return line.indexOf("-->") != -1;
+    case html_block::instruction: return line.indexOf("?>") != -1;
+    case html_block::declaration: return line.indexOf('>') != -1;
+    case html_block::cdata: return line.indexOf("]]>") != -1;
+    case html_block::none: break;
+    }
+    return true;
+}
+
+MarkdownSplitScan scanSplitPoints(QByteArrayView text){
+    MarkdownSplitScan result;
+
+    bool in_fence = false;
+    char fence_char;
+    int fence_open_length = 0;
+    html_block in_html = html_block::none;
+    QByteArrayView html_tag;
+    bool in_list = false;
+    bool previous_blank = false;
+
+    qsizetype pos = 0;
+    while(pos < text.size()){
+        qsizetype line_end = text.indexOf('\n', pos);
+        bool complete = line_end != -1;
+        if(!complete) line_end = text.size();
+        QByteArrayView line = text.mid(pos, line_end - pos);
+        qsizetype line_start = pos;
+        pos = line_end + 1;
+
+        if(in_fence){
+            if(closes_fence(line, fence_char, fence_open_length)){
+                in_fence = false;
+            }
+            previous_blank = false;
+            continue;
+        }
+        if(in_html != html_block::none){
+            if(closes_html_block(line, in_html, html_tag)){
+                in_html = html_block::none;
+            }
+            previous_blank = false;
+            continue;
+        }
+
+        if(is_blank(line)){
+            previous_blank = true;
+            continue;
+        }
+
+        int indent = leading_spaces(line);
+        bool list_marker = indent <= 3 && is_list_marker(line);
+
+        if(previous_blank && indent == 0 && complete && line_start > 0){
+            if(!(in_list && list_marker)){
+                result.splits.push_back(line_start);
+                in_list = false;
+            }
+        }
+        previous_blank = false;
+
+        if(indent <= 3){
+            int n = fence_length(line, fence_char);
+            if(n > 0){
+                in_fence = true;
+                fence_open_length = n;
+                continue;
+            }
+            html_block kind = html_block_start(line, html_tag);
+            if(kind != html_block::none){
+                //the end marker may already be on the opening line
+                qsizetype open = line.indexOf('<');
+                QByteArrayView after_open = line.mid(open + (kind == html_block::comment ? 4 : 2));
+                if(!closes_html_block(after_open, kind, html_tag)) in_html = kind;
+                continue;
+            }
+            if(is_reference_definition(line)){
+                result.has_reference_definition = true;
+            }
+        }
+        if(list_marker){
+            in_list = true;
+        }
+    }
+
+    return result;
+}
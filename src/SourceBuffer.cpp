@@ -0,0 +1,56 @@
+#include "SourceBuffer.h"
+#include <QFile>
+#include <cstring>
+
+struct SourceBuffer::mapped_file{
+    QFile file;
+    uchar* data = nullptr;
+
+    ~mapped_file(){
+        if(data) file.unmap(data);
+    }
+};
+
+bool SourceBuffer::mapFile(const QString& path){
+    clear();
+    auto file = std::make_shared<mapped_file>();
+    file->file.setFileName(path);
+    if(!file->file.open(QIODevice::ReadOnly)) return false;
+    qint64 size = file->file.size();
+    if(size == 0) return true; //nothing to map, an empty document
+    file->data = file->file.map(0, size);
+    if(!file->data) return false;
+
+    const char* bytes = reinterpret_cast<const char*>(file->data);
+    //md4c doesn't skip a byte order mark
+    if(size >= 3 && std::memcmp(bytes, "\xEF\xBB\xBF", 3) == 0){
+        bytes += 3;
+        size -= 3;
+    }
+    m_bytes = QByteArray::fromRawData(bytes, size);
+    m_mapping = file;
+    return true;
+}
+
+void SourceBuffer::assign(QByteArray utf8){
+    m_bytes = std::move(utf8);
+    m_mapping.reset();
+}
+
+void SourceBuffer::append(QByteArrayView utf8){
+    if(utf8.isEmpty()) return;
+    if(m_mapping){
+        //the mapping is read-only, appending makes the buffer our own
+        QByteArray owned;
+        owned.reserve(m_bytes.size() + utf8.size());
+        owned.append(m_bytes.constData(), m_bytes.size());
+        m_bytes = std::move(owned);
+        m_mapping.reset();
+    }
+    m_bytes.append(utf8);
+}
+
+void SourceBuffer::clear(){
+    m_bytes.clear();
+    m_mapping.reset();
+}
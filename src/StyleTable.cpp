@@ -0,0 +1,160 @@
+#include "StyleTable.h"
+#include <algorithm>
+
+static constexpr int style_count = static_cast<int>(font_type::heading6) + 1;
+
+StyleTable::StyleTable() : StyleTable(12, "Arial", "Monaco"){
+}
+
+StyleTable::StyleTable(int text_size, const QString& family, const QString& code_family){
+    rebuild(text_size, family, code_family);
+}
+
+int WordAdvanceCache::advance(const textStyle& style, uint8_t style_id, const QString& word){
+    word_key key{word, style_id};
+    auto it = m_current.constFind(key);
+    if(it != m_current.constEnd()){
+        m_hits++;
+        return it.value();
+    }
+    int width;
+    auto old = m_previous.constFind(key);
+    if(old != m_previous.constEnd()){
+        m_hits++;
+        width = old.value();
+    }
+    else{
+        m_misses++;
+        width = style.metrics.horizontalAdvance(word);
+    }
+    if(m_current.size() >= (qsizetype)(m_capacity / 2)){
+        m_evictions += m_previous.size();
+        m_previous = std::move(m_current);
+        m_current = QHash<word_key, int>();
+    }
+    m_current.insert(key, width);
+    return width;
+}
+
+void WordAdvanceCache::clear(){
+    m_current.clear();
+    m_previous.clear();
+}
+
+void WordAdvanceCache::setCapacity(size_t entries){
+    m_capacity = std::max<size_t>(entries, 2);
+    clear();
+}
+
+word_advance_stats WordAdvanceCache::stats() const{
+    word_advance_stats result;
+    result.hits = m_hits;
+    result.misses = m_misses;
+    result.evictions = m_evictions;
+    result.entries = m_current.size() + m_previous.size();
+    result.capacity = m_capacity;
+    return result;
+}
+
+void WordAdvanceCache::resetStats(){
+    m_hits = 0;
+    m_misses = 0;
+    m_evictions = 0;
+}
+
+void StyleTable::rebuild(int text_size, const QString& family, const QString& code_family){
+    m_advances.clear(); // widths belong to the old fonts
+    m_styles.clear();
+    m_styles.reserve(style_count);
+    for(int i = 0; i < style_count; i++){
+        QFont font = resolve(static_cast<font_type>(i), text_size, family, code_family);
+        QFontMetrics metrics(font);
+        m_styles.push_back(textStyle{font, metrics, QFontMetricsF(font), metrics.horizontalAdvance(' '), metrics.ascent(), metrics.height(), metrics.lineSpacing()});
+    }
+}
+
+QFont StyleTable::resolve(font_type type, int text_size, const QString& family, const QString& code_family) const{
+    // Start with the base font
+    QFont font(family, text_size);
+
+    switch (type) {
+        case font_type::bold:
+            font.setBold(true);
+            break;
+
+        case font_type::italic:
+            font.setItalic(true);
+            break;
+
+        case font_type::italic_bold:
+            font.setBold(true);
+            font.setItalic(true);
+            break;
+
+        case font_type::mono:
+            font.setFamily(code_family);
+            break;
+        case font_type::strikethrough:
+            font.setStrikeOut(true);
+            break;
+
+        case font_type::underline:
+        case font_type::hyperlink: // Links are also underlined
+            font.setUnderline(true);
+            break;
+
+        // Handle all heading levels
+        case font_type::heading1:
+        case font_type::heading2:
+        case font_type::heading3:
+        case font_type::heading4:
+        case font_type::heading5:
+        case font_type::heading6:
+        {
+            int level = static_cast<int>(type) - static_cast<int>(font_type::heading1) + 1;
+            int headingSize = std::max(8, text_size + (6 - level) * 4);
+            font.setPointSize(headingSize);
+            font.setBold(true);
+            break;
+        }
+
+        case font_type::normal:
+        default:
+            // Do nothing, use the default font
+            break;
+    }
+
+    return font;
+}
+
+font_type StyleTable::styleOf(const Element& element){
+    if(element.type==DisplayType::block){
+        if(element.block_type==MD_BLOCK_H){
+            int level = std::clamp(std::get<heading_data>(element.data).level, 1, 6);
+            return static_cast<font_type>(static_cast<int>(font_type::heading1) + level - 1);
+        }
+        if(element.block_type==MD_BLOCK_CODE){
+            return font_type::mono;
+        }
+        return font_type::normal;
+    }
+
+    switch (element.span_type) {
+        case spantype::bold:
+            return font_type::bold;
+        case spantype::italic:
+            return font_type::italic;
+        case spantype::underline:
+            return font_type::underline;
+        case spantype::hyperlink:
+            return font_type::hyperlink;
+        case spantype::strikethrough:
+            return font_type::strikethrough;
+        case spantype::code:
+            return font_type::mono;
+        case spantype::italic_bold:
+            return font_type::italic_bold;
+        default:
+            return font_type::normal;
+    }
+}
@@ -0,0 +1,108 @@
+#include "TileCache.h"
+#include <algorithm>
+
+void TileCache::setTileHeight(int height){
+    height = std::max(height, 16);
+    if(height == m_tile_height) return;
+    m_tile_height = height;
+    clear();
+}
+
+void TileCache::setGeometry(int width, qreal device_pixel_ratio){
+    if(width == m_width && device_pixel_ratio == m_device_pixel_ratio) return;
+    m_width = width;
+    m_device_pixel_ratio = device_pixel_ratio;
+    clear();
+}
+
+const QImage* TileCache::find(int tile){
+    auto it = m_entries.find(tile);
+    if(it == m_entries.end()){
+        m_misses++;
+        return nullptr;
+    }
+    m_hits++;
+    m_lru.splice(m_lru.begin(), m_lru, it.value());
+    return &it.value()->image;
+}
+
+const QImage& TileCache::insert(int tile, QImage image){
+    auto it = m_entries.find(tile);
+    if(it != m_entries.end()){
+        m_bytes -= it.value()->bytes;
+        m_lru.erase(it.value());
+        m_entries.erase(it);
+    }
+    size_t bytes = static_cast<size_t>(image.sizeInBytes());
+    m_lru.push_front(cache_entry{tile, std::move(image), bytes});
+    m_entries.insert(tile, m_lru.begin());
+    m_bytes += bytes;
+    evict();
+    return m_lru.front().image;
+}
+
+void TileCache::invalidate(int top, int bottom){
+    if(m_entries.isEmpty() || bottom < top) return;
+    int first = tileAt(top);
+    int last = tileAt(bottom);
+    if(last - first >= m_entries.size()){
+        //a long range, cheaper to look at what is cached
+        for(auto it = m_lru.begin(); it != m_lru.end();){
+            if(it->tile >= first && it->tile <= last){
+                m_bytes -= it->bytes;
+                m_entries.remove(it->tile);
+                it = m_lru.erase(it);
+            }
+            else{
+                ++it;
+            }
+        }
+        return;
+    }
+    for(int tile = first; tile <= last; tile++){
+        auto it = m_entries.find(tile);
+        if(it == m_entries.end()) continue;
+        m_bytes -= it.value()->bytes;
+        m_lru.erase(it.value());
+        m_entries.erase(it);
+    }
+}
+
+void TileCache::clear(){
+    m_entries.clear();
+    m_lru.clear();
+    m_bytes = 0;
+}
+
+void TileCache::evict(){
+    //the front was just painted, it is kept even if it alone is over budget
+    while(m_bytes > m_byte_budget && m_lru.size() > 1){
+        cache_entry& victim = m_lru.back();
+        m_bytes -= victim.bytes;
+        m_entries.remove(victim.tile);
+        m_lru.pop_back();
+        m_evictions++;
+    }
+}
+
+void TileCache::setByteBudget(size_t bytes){
+    m_byte_budget = bytes;
+    evict();
+}
+
+tile_cache_stats TileCache::stats() const{
+    tile_cache_stats result;
+    result.hits = m_hits;
+    result.misses = m_misses;
+    result.evictions = m_evictions;
+    result.tiles = m_lru.size();
+    result.bytes = m_bytes;
+    result.byte_budget = m_byte_budget;
+    return result;
+}
+
+void TileCache::resetStats(){
+    m_hits = 0;
+    m_misses = 0;
+    m_evictions = 0;
+}
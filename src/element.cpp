@@ -3,10 +3,10 @@
 #include <md4c.h>
 #include <iostream>
 #include <variant>
-Element::Element(DisplayType type, ElementData data,spantype span_type, MD_BLOCKTYPE block_type): type(type),data(data){
+#include <algorithm>
+#include <iterator>
+Element::Element(DisplayType type, ElementData data,spantype span_type, MD_BLOCKTYPE block_type): type(type),block_type(block_type),span_type(span_type),data(data){
     if(type==DisplayType::block){
-        subtype = malloc(sizeof(MD_BLOCKTYPE));
-        *(MD_BLOCKTYPE*)subtype = block_type;
         switch(block_type) {
             case MD_BLOCK_H:
                 this->data= heading_data();
@@ -26,8 +26,6 @@ Element::Element(DisplayType type, ElementData data,spantype span_type, MD_BLOCK
         }
     }
     else{//span element
-        subtype = malloc(sizeof(spantype));
-        *(spantype*)subtype = span_type;
         switch(span_type){
             case image://image not supported yet
                 break;
@@ -47,13 +45,73 @@ Element::Element(DisplayType type, ElementData data,spantype span_type, MD_BLOCK
     }
 }
 
-Element::~Element(){
-    free(subtype);
-    for (Element* child : children) {
-        delete child;
+void ElementTree::truncate(size_t nodes){
+    if(nodes < m_nodes.size()){
+        m_nodes.erase(m_nodes.begin() + nodes, m_nodes.end());
     }
 }
 
+size_t ElementTree::addChild(Element element){
+    m_building.push_back(std::move(element));
+    return m_building.size() - 1;
+}
+
+void ElementTree::openBlock(Element element){
+    size_t handle = addChild(std::move(element));
+    m_open.push_back(open_block{handle, m_building.size()});
+}
+
+void ElementTree::closeBlock(){
+    open_block block = m_open.back();
+    m_open.pop_back();
+    Element& parent = m_building[block.node];
+    parent.first_child = static_cast<uint32_t>(m_nodes.size());
+    parent.child_count = static_cast<uint32_t>(m_building.size() - block.children);
+    std::move(m_building.begin() + block.children, m_building.end(), std::back_inserter(m_nodes));
+    m_building.erase(m_building.begin() + block.children, m_building.end());
+}
+
+void ElementTree::dropLastChild(){
+    if(openChildCount() > 0){
+        m_building.pop_back();
+    }
+}
+
+Element ElementTree::finishDocument(){
+    while(!m_open.empty()){
+        closeBlock();
+    }
+    if(m_building.empty()){
+        return Element(DisplayType::block, {}, spantype::normal, MD_BLOCK_DOC);
+    }
+    Element root = std::move(m_building.front());
+    m_building.clear();
+    return root;
+}
+
+void ElementTree::abandon(size_t nodes){
+    m_open.clear();
+    m_building.clear();
+    truncate(nodes);
+}
+
+uint32_t ElementTree::append(ElementTree&& other){
+    uint32_t offset = static_cast<uint32_t>(m_nodes.size());
+    m_nodes.reserve(m_nodes.size() + other.m_nodes.size());
+    for(Element& element : other.m_nodes){
+        //child runs were indexed from other's start
+        if(element.child_count > 0) element.first_child += offset;
+        m_nodes.push_back(std::move(element));
+    }
+    other.clear();
+    return offset;
+}
+
+static std::ostream& operator<<(std::ostream& os, const source_text& text) {
+    if(text.literal.isNull()) return os << "@" << text.range.offset << "+" << text.range.length;
+    return os << "\"" << text.literal.toStdString() << "\"";
+}
+
 // Helper function to convert MD_BLOCKTYPE to string
 const char* blockTypeToString(MD_BLOCKTYPE blockType) {
     switch(blockType) {
@@ -97,7 +155,7 @@ const char* spanTypeToString(spantype spanType) {
 
 std::ostream& operator<<(std::ostream& os, const Element& element) {
     if (element.type == DisplayType::block) {
-        MD_BLOCKTYPE blockType = *((MD_BLOCKTYPE*)element.subtype);
+        MD_BLOCKTYPE blockType = element.block_type;
         os << "Block[" << blockTypeToString(blockType) << "]";
 
         // Print specific block data
@@ -108,7 +166,7 @@ std::ostream& operator<<(std::ostream& os, const Element& element) {
             } else if constexpr (std::is_same_v<T, heading_data>) {
                 os << " level=" << data.level;
             } else if constexpr (std::is_same_v<T, code_block_data>) {
-                os << " lang=\"" << data.language.toStdString() << "\"";
+                os << " lang=" << data.language;
             } else if constexpr (std::is_same_v<T, list_data>) {
                 os << " ordered=" << (data.is_ordered ? "true" : "false");
                 if (data.is_ordered) {
@@ -121,7 +179,7 @@ std::ostream& operator<<(std::ostream& os, const Element& element) {
             }
         }, element.data);
     } else {
-        spantype spanType = *((spantype*)element.subtype);
+        spantype spanType = element.span_type;
         os << "Span[" << spanTypeToString(spanType) << "]";
 
         // Print specific span data
@@ -130,18 +188,18 @@ std::ostream& operator<<(std::ostream& os, const Element& element) {
             if constexpr (std::is_same_v<T, std::monostate>) {
                 os << " (no data)";
             } else if constexpr (std::is_same_v<T, span_data>) {
-                os << " text=\"" << data.text.toStdString() << "\"";
+                os << " text=" << data.text;
             } else if constexpr (std::is_same_v<T, link_data>) {
-                os << " url=\"" << data.url.toStdString() << "\" title=\"" << data.title.toStdString() << "\"";
+                os << " url=" << data.url << " title=" << data.title;
             } else if constexpr (std::is_same_v<T, latex_data>) {
-                os << " text=\"" << data.text.toStdString() << "\" inline=" << (data.isInline ? "true" : "false");
+                os << " text=" << data.text << " inline=" << (data.isInline ? "true" : "false");
             }
         }, element.data);
     }
 
     // Print children count
-    if (!element.children.empty()) {
-        os << " children=" << element.children.size();
+    if (element.child_count > 0) {
+        os << " children=" << element.child_count;
     }
 
     return os;
@@ -7,6 +7,7 @@
 #include <QTimer>
 #include <QComboBox>
 #include <QPushButton>
+#include <QCheckBox>
 #include <QLabel>
 #include <QFileDialog>
 #include <QTextStream>
@@ -14,6 +15,9 @@
 #include <QSettings>
 #include <iostream>
 #include "LatexLabel.h"
+#include "LatexCache.h"
+#include "FormulaDiskCache.h"
+#include <QStandardPaths>
 #include <QScrollArea>
 
 //Simple text streaming
@@ -28,6 +32,7 @@ QString accumulated_text = "";
 void add_next_word() {
     if (!label_ref || line_index >= lines.size()) {
         stream_timer->stop();
+        if (label_ref) label_ref->flushQueuedText(); //end of the stream, no need to wait for the next frame
         return;
     }
 
@@ -40,7 +45,7 @@ void add_next_word() {
         //If the line is empty (just whitespace), add it as-is and move to next line
         if (current_line_words.isEmpty()) {
             accumulated_text += line + "\n";
-            label_ref->appendText(accumulated_text);
+            label_ref->queueText(accumulated_text);
             accumulated_text = "";
             line_index++;
             return;
@@ -78,7 +83,7 @@ void add_next_word() {
         word_index = 0;
     }
 
-    label_ref->appendText(accumulated_text);
+    label_ref->queueText(accumulated_text); //words come faster than frames, parsed together
     accumulated_text = "";
 }
 
@@ -115,6 +120,12 @@ int main(int argc, char* argv[]){
     // Initialize MicroTeX with the absolute path to resources
     tex::LaTeX::init(resPath.toStdString());
 
+    // Formulas of documents opened before are laid out and painted without being rebuilt
+    QString cacheDir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    if(!cacheDir.isEmpty() && QDir().mkpath(cacheDir)) {
+        FormulaDiskCache::instance().open(cacheDir + "/formulas.cache");
+    }
+
     window.setWindowTitle("LaTeX Label Test Suite");
 
     // Initialize settings
@@ -130,11 +141,13 @@ int main(int argc, char* argv[]){
     QComboBox* fileSelector = new QComboBox();
     QPushButton* loadButton = new QPushButton("Load Test");
     QPushButton* browseButton = new QPushButton("Browse...");
+    QCheckBox* virtualizedBox = new QCheckBox("Virtualized");
 
     controlLayout->addWidget(selectorLabel);
     controlLayout->addWidget(fileSelector);
     controlLayout->addWidget(loadButton);
     controlLayout->addWidget(browseButton);
+    controlLayout->addWidget(virtualizedBox);
     controlLayout->addStretch();
 
     mainLayout->addLayout(controlLayout);
@@ -153,6 +166,10 @@ int main(int argc, char* argv[]){
     label->setTextSize(20);
     label->setText("Select a test file to load markdown content with LaTeX support.");
     scroll->setWidget(label);
+    //large documents only get laid out around the part that is scrolled into view
+    QObject::connect(virtualizedBox, &QCheckBox::toggled, [label](bool checked) {
+        label->setVirtualized(checked);
+    });
 
     mainLayout->addWidget(scroll);
     window.setCentralWidget(centralWidget);
@@ -204,13 +221,8 @@ int main(int argc, char* argv[]){
         }
 
         QString filePath = testsDir + "/" + selectedFile;
-        QFile file(filePath);
 
-        if (file.open(QIODevice::ReadOnly | QIODevice::Text)) {
-            QTextStream in(&file);
-            QString content = in.readAll();
-            file.close();
-            label->setText(content);
+        if (label->setFile(filePath)) { //parsed straight from the mapped file
             //start_text_streaming(content, label);
             //label->printSegmentsStructure();
 
@@ -288,6 +300,8 @@ int main(int argc, char* argv[]){
     int retn = app.exec();
 
     // Clean up MicroTeX resources
+    LatexRenderCache::instance().waitForAsyncBuilds();
+    FormulaDiskCache::instance().close();
     tex::LaTeX::release();
     return retn;
 }